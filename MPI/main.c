@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <mpi.h>
 
 typedef struct
@@ -36,12 +38,92 @@ typedef struct
     unsigned char *data;
 } Image;
 
-unsigned char *leBitMap(const char *filename, int *w, int *h, BMPHeader *outHead, BMPInfoHeader *outInfo)
+// Pool de buffers de pixels e de rascunho. Todo buffer sai alinhado a 64 bytes (linha de
+// cache e largura do AVX-512); a partir de 2 MB sai alinhado à huge page e com
+// MADV_HUGEPAGE, para o kernel usar huge pages transparentes e cortar as faltas de TLB.
+// liberaBuffer devolve o buffer ao pool, e o próximo pedido de tamanho parecido o
+// reaproveita sem passar pelo malloc nem pelas faltas de página do primeiro acesso.
+#define ALINHAMENTO_BUFFER 64
+#define TAMANHO_HUGE_PAGE (2 * 1024 * 1024)
+#define MAX_BUFFERS_POOL 32
+
+typedef struct
 {
-    FILE *f = fopen(filename, "rb");
-    if (!f)
+    void *ptr;
+    size_t tamanho;
+    int livre;
+} BufferPool;
+
+BufferPool pool[MAX_BUFFERS_POOL];
+int nPool = 0;
+int poolAtivo = 1; // --sem-pool usa malloc/free direto, para comparação
+
+void *alocaBuffer(size_t n)
+{
+    if (n == 0)
+        n = 1;
+    if (!poolAtivo)
+        return malloc(n);
+
+    // Menor buffer livre em que n caiba sem desperdiçar mais da metade
+    int melhor = -1;
+    for (int i = 0; i < nPool; i++)
+    {
+        if (pool[i].livre && pool[i].tamanho >= n && pool[i].tamanho / 2 <= n &&
+            (melhor < 0 || pool[i].tamanho < pool[melhor].tamanho))
+            melhor = i;
+    }
+    if (melhor >= 0)
+    {
+        pool[melhor].livre = 0;
+        return pool[melhor].ptr;
+    }
+
+    size_t alinhamento = n >= TAMANHO_HUGE_PAGE ? TAMANHO_HUGE_PAGE : ALINHAMENTO_BUFFER;
+    size_t tamanho = (n + alinhamento - 1) / alinhamento * alinhamento;
+    void *p;
+    if (posix_memalign(&p, alinhamento, tamanho) != 0)
         return NULL;
+#ifdef MADV_HUGEPAGE
+    if (alinhamento == TAMANHO_HUGE_PAGE)
+        madvise(p, tamanho, MADV_HUGEPAGE);
+#endif
+
+    // Com o pool cheio o buffer não é registrado e liberaBuffer o devolve ao sistema
+    if (nPool < MAX_BUFFERS_POOL)
+    {
+        pool[nPool].ptr = p;
+        pool[nPool].tamanho = tamanho;
+        pool[nPool].livre = 0;
+        nPool++;
+    }
+    return p;
+}
+
+void liberaBuffer(void *p)
+{
+    if (!p)
+        return;
+    for (int i = 0; i < nPool; i++)
+    {
+        if (pool[i].ptr == p)
+        {
+            pool[i].livre = 1;
+            return;
+        }
+    }
+    free(p);
+}
+
+void liberaPool()
+{
+    for (int i = 0; i < nPool; i++)
+        free(pool[i].ptr);
+    nPool = 0;
+}
 
+void leCabecalhos(FILE *f, BMPHeader *outHead, BMPInfoHeader *outInfo)
+{
     fread(&outHead->bfType, sizeof(uint16_t), 1, f);
     fread(&outHead->bfSize, sizeof(uint32_t), 1, f);
     fread(&outHead->bfReserved1, sizeof(uint16_t), 1, f);
@@ -59,27 +141,102 @@ unsigned char *leBitMap(const char *filename, int *w, int *h, BMPHeader *outHead
     fread(&outInfo->biYPelsPerMeter, sizeof(int32_t), 1, f);
     fread(&outInfo->biClrUsed, sizeof(uint32_t), 1, f);
     fread(&outInfo->biClrImportant, sizeof(uint32_t), 1, f);
+}
+
+// Só as dimensões e os canais, sem ler os pixels. Retorna 0 se não for um BMP suportado.
+int dimensoesBitMap(const char *filename, int *w, int *h, int *canais)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return 0;
+    BMPHeader head;
+    BMPInfoHeader info;
+    leCabecalhos(f, &head, &info);
+    fclose(f);
+    if (head.bfType != 0x4D42 || (info.biBitCount != 8 && info.biBitCount != 24 && info.biBitCount != 32))
+        return 0;
+    *w = info.biWidth;
+    *h = abs(info.biHeight);
+    *canais = info.biBitCount / 8;
+    return 1;
+}
+
+unsigned char *leBitMap(const char *filename, int *w, int *h, BMPHeader *outHead, BMPInfoHeader *outInfo)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return NULL;
+
+    leCabecalhos(f, outHead, outInfo);
+
+    if (outHead->bfType != 0x4D42 ||
+        (outInfo->biBitCount != 8 && outInfo->biBitCount != 24 && outInfo->biBitCount != 32))
+    {
+        fclose(f);
+        return NULL;
+    }
 
-    if (outHead->bfType != 0x4D42 || outInfo->biBitCount != 24)
+    // 32 bits pode vir como BI_BITFIELDS (3): aceita apenas o layout BGRA
+    if (outInfo->biCompression == 3 && outInfo->biBitCount == 32)
+    {
+        uint32_t mascaras[3];
+        fseek(f, 14 + 40, SEEK_SET);
+        fread(mascaras, sizeof(uint32_t), 3, f);
+        if (mascaras[0] != 0x00FF0000 || mascaras[1] != 0x0000FF00 || mascaras[2] != 0x000000FF)
+        {
+            fclose(f);
+            return NULL;
+        }
+    }
+    else if (outInfo->biCompression != 0)
     {
         fclose(f);
         return NULL;
     }
 
+    // 8 bits: a paleta precisa ser de tons de cinza; guarda o nível de cinza de cada índice
+    unsigned char paleta[256];
+    int paletaIdentidade = 1;
+    for (int i = 0; i < 256; i++)
+        paleta[i] = (unsigned char)i;
+
+    if (outInfo->biBitCount == 8)
+    {
+        int nCores = (outInfo->biClrUsed > 0 && outInfo->biClrUsed <= 256) ? outInfo->biClrUsed : 256;
+        fseek(f, 14 + outInfo->biSize, SEEK_SET);
+        for (int i = 0; i < nCores; i++)
+        {
+            unsigned char cor[4];
+            fread(cor, 1, 4, f);
+            if (cor[0] != cor[1] || cor[1] != cor[2])
+            {
+                fclose(f);
+                return NULL;
+            }
+            paleta[i] = cor[0];
+            if (cor[0] != i)
+                paletaIdentidade = 0;
+        }
+    }
+
     *w = outInfo->biWidth;
     *h = abs(outInfo->biHeight);
+    int canais = outInfo->biBitCount / 8;
+    int rowSize = (*w) * canais;
 
-    unsigned char *data = (unsigned char *)malloc((*w) * (*h) * 3);
-    int padding = (4 - ((*w) * 3) % 4) % 4;
+    unsigned char *data = (unsigned char *)alocaBuffer((size_t)rowSize * (*h));
+    int padding = (4 - rowSize % 4) % 4;
 
     fseek(f, outHead->bfOffBits, SEEK_SET);
 
     for (int y = 0; y < *h; y++)
     {
-        for (int x = 0; x < *w; x++)
+        unsigned char *linha = &data[(size_t)y * rowSize];
+        fread(linha, rowSize, 1, f);
+        if (!paletaIdentidade)
         {
-            int index = (y * (*w) + x) * 3;
-            fread(&data[index], 3, 1, f);
+            for (int x = 0; x < rowSize; x++)
+                linha[x] = paleta[linha[x]];
         }
         fseek(f, padding, SEEK_CUR);
     }
@@ -87,17 +244,16 @@ unsigned char *leBitMap(const char *filename, int *w, int *h, BMPHeader *outHead
     return data;
 }
 
-void escreveBitMap(const char *filename, int w, int h, unsigned char *data, BMPHeader head, BMPInfoHeader info)
+// Grava no mesmo formato (bits por pixel e orientação) descrito por info
+// Grava os cabeçalhos já preenchidos e, em 8 bits, a paleta de tons de cinza. Os campos de
+// tamanho saem de dataSize; acima de 4 GB não cabem em 32 bits e são gravados como 0, já que a
+// leitura usa só largura, altura e bfOffBits.
+void escreveCabecalhos(FILE *f, BMPHeader head, BMPInfoHeader info, uint64_t dataSize)
 {
-    FILE *f = fopen(filename, "wb");
-    if (!f)
-        return;
-
-    int padding = (4 - (w * 3) % 4) % 4;
-    int dataSize = (w * 3 + padding) * h;
-
-    head.bfSize = 14 + 40 + dataSize;
-    info.biSizeImage = dataSize;
+    uint64_t fileSize = head.bfOffBits + dataSize;
+    int cabe32 = fileSize <= UINT32_MAX;
+    head.bfSize = cabe32 ? (uint32_t)fileSize : 0;
+    info.biSizeImage = cabe32 ? (uint32_t)dataSize : 0;
 
     fwrite(&head.bfType, sizeof(uint16_t), 1, f);
     fwrite(&head.bfSize, sizeof(uint32_t), 1, f);
@@ -117,226 +273,944 @@ void escreveBitMap(const char *filename, int w, int h, unsigned char *data, BMPH
     fwrite(&info.biClrUsed, sizeof(uint32_t), 1, f);
     fwrite(&info.biClrImportant, sizeof(uint32_t), 1, f);
 
+    // Paleta de tons de cinza para 8 bits
+    for (int i = 0; i < (info.biBitCount == 8 ? 256 : 0); i++)
+    {
+        unsigned char cor[4] = {(unsigned char)i, (unsigned char)i, (unsigned char)i, 0};
+        fwrite(cor, 1, 4, f);
+    }
+}
+
+void escreveBitMap(const char *filename, int w, int h, unsigned char *data, BMPHeader head, BMPInfoHeader info)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+        return;
+
+    int canais = info.biBitCount / 8;
+    int rowSize = w * canais;
+    int padding = (4 - rowSize % 4) % 4;
+    uint64_t dataSize = (uint64_t)(rowSize + padding) * h;
+    int paletaSize = canais == 1 ? 256 * 4 : 0;
+
+    head.bfOffBits = 14 + 40 + paletaSize;
+    info.biSize = 40;
+    info.biCompression = 0;
+    info.biClrUsed = canais == 1 ? 256 : 0;
+    info.biClrImportant = 0;
+
+    escreveCabecalhos(f, head, info, dataSize);
+
     for (int y = 0; y < h; y++)
     {
-        for (int x = 0; x < w; x++)
-        {
-            int index = (y * w + x) * 3;
-            fwrite(&data[index], 3, 1, f);
-        }
+        fwrite(&data[(size_t)y * rowSize], rowSize, 1, f);
         unsigned char pad[3] = {0, 0, 0};
         fwrite(pad, 1, padding, f);
     }
     fclose(f);
 }
 
+// Maior RLE8 possível para uma linha: cada pixel num par (1, valor), mais o fim de linha
+#define LIMITE_RLE8(w) (2 * (size_t)(w) + 2)
+
+// Quantos pixels iguais ao de x seguem a partir de x, até max
+static inline int comprimentoRun(const unsigned char *linha, int x, int w, int canais, int max)
+{
+    int n = 1;
+    while (x + n < w && n < max && linha[(x + n) * canais] == linha[x * canais])
+        n++;
+    return n;
+}
+
+// Codifica as linhas [y0, y1) em RLE8, cada uma terminada por fim de linha (0, 0); o byte 0
+// de cada pixel é o cinza. invertido percorre de y1 - 1 até y0. Retorna os bytes gravados.
+size_t codificaRle8(const unsigned char *data, int w, int canais, int y0, int y1, int invertido, unsigned char *saida)
+{
+    unsigned char *p = saida;
+    for (int i = y0; i < y1; i++)
+    {
+        int y = invertido ? y0 + y1 - 1 - i : i;
+        const unsigned char *linha = data + (size_t)y * w * canais;
+        int x = 0;
+        while (x < w)
+        {
+            int run = comprimentoRun(linha, x, w, canais, 255);
+            if (run >= 3)
+            {
+                *p++ = (unsigned char)run;
+                *p++ = linha[x * canais];
+                x += run;
+                continue;
+            }
+
+            // Modo absoluto até o próximo run de 3 ou mais; ele exige pelo menos 3 pixels
+            int fim = x + 1;
+            while (fim < w && fim - x < 255 &&
+                   !(fim + 2 < w && linha[fim * canais] == linha[(fim + 1) * canais] && linha[fim * canais] == linha[(fim + 2) * canais]))
+                fim++;
+            int n = fim - x;
+            if (n >= 3)
+            {
+                *p++ = 0;
+                *p++ = (unsigned char)n;
+                for (; x < fim; x++)
+                    *p++ = linha[x * canais];
+                if (n & 1)
+                    *p++ = 0; // Cada bloco absoluto termina alinhado em 16 bits
+            }
+            else
+            {
+                while (x < fim)
+                {
+                    int r = comprimentoRun(linha, x, fim, canais, 2);
+                    *p++ = (unsigned char)r;
+                    *p++ = linha[x * canais];
+                    x += r;
+                }
+            }
+        }
+        *p++ = 0;
+        *p++ = 0;
+    }
+    return p - saida;
+}
+
+// Grava o RLE8 já codificado (com o fim do bitmap) como BMP de 8 bits comprimido
+void escreveBitMapRle8(const char *filename, int h, const unsigned char *rle, size_t tamanho, BMPHeader head, BMPInfoHeader info)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+        return;
+
+    head.bfOffBits = 14 + 40 + 256 * 4;
+    info.biSize = 40;
+    info.biHeight = h; // RLE8 é sempre de baixo para cima
+    info.biBitCount = 8;
+    info.biCompression = 1;
+    info.biClrUsed = 256;
+    info.biClrImportant = 0;
+
+    escreveCabecalhos(f, head, info, tamanho);
+    fwrite(rle, 1, tamanho, f);
+    fclose(f);
+}
+
 int compare(const void *a, const void *b)
 {
     return (*(unsigned char *)a - *(unsigned char *)b);
 }
 
-int main(int argc, char *argv[])
+typedef enum
 {
-    MPI_Init(&argc, &argv);
+    BORDA_COPIAR,    // Mantém os pixels da borda sem filtrar
+    BORDA_REPLICAR,  // Repete o pixel mais próximo da borda
+    BORDA_REFLETIR,  // Espelha a imagem a partir da borda
+    BORDA_CONSTANTE  // Completa a janela com um valor fixo
+} ModoBorda;
 
-    int world_rank, world_size;
-    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+int leModoBorda(const char *nome, ModoBorda *modo)
+{
+    if (strcmp(nome, "copiar") == 0)
+        *modo = BORDA_COPIAR;
+    else if (strcmp(nome, "replicar") == 0)
+        *modo = BORDA_REPLICAR;
+    else if (strcmp(nome, "refletir") == 0)
+        *modo = BORDA_REFLETIR;
+    else if (strcmp(nome, "constante") == 0)
+        *modo = BORDA_CONSTANTE;
+    else
+        return 0;
+    return 1;
+}
 
-    if (argc < 2)
-    {
-        if (world_rank == 0)
-            printf("Uso: mpirun -np X %s <tamanho_filtro_N>\n", argv[0]);
-        MPI_Finalize();
-        return 1;
-    }
+// Converte uma coordenada fora da imagem para uma coordenada válida conforme o modo.
+// Retorna -1 quando o vizinho deve assumir o valor constante.
+int indiceBorda(int i, int n, ModoBorda modo)
+{
+    if (i >= 0 && i < n)
+        return i;
+    if (modo == BORDA_CONSTANTE)
+        return -1;
+    if (modo == BORDA_REFLETIR)
+        i = (i < 0) ? -i - 1 : 2 * n - i - 1;
+    if (i < 0)
+        i = 0;
+    if (i >= n)
+        i = n - 1;
+    return i;
+}
 
-    int n_filter = atoi(argv[1]);
-    if (n_filter % 2 == 0)
-        n_filter++;
-    int offset = n_filter / 2;
+unsigned char mediana(unsigned char *window, int windowSize)
+{
+    qsort(window, windowSize, sizeof(unsigned char), compare);
+    return window[windowSize / 2];
+}
 
-    int w, h;
-    unsigned char *full_img = NULL;
-    BMPHeader bmpHead;
-    BMPInfoHeader bmpInfo;
+// As linhas de src começam na linha global srcY0; dst aponta para a linha de saída y
 
-    if (world_rank == 0)
+// Pixels cuja janela cabe inteira na imagem: nenhum teste de borda no laço.
+// Cinza (1 canal) tem um laço próprio; em BGRA o alfa é copiado do pixel central.
+void medianaInterior(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int offset, int canais,
+                     unsigned char *winB, unsigned char *winG, unsigned char *winR)
+{
+    int window_size = (2 * offset + 1) * (2 * offset + 1);
+
+    if (canais == 1)
     {
-        full_img = readBMP("../bitmaps/small.bmp", &w, &h, &bmpHead, &bmpInfo);
-        if (!full_img)
+        for (int x = x0; x < x1; x++)
         {
-            printf("Erro ao ler ../bitmaps/small.bmp\n");
-            MPI_Abort(MPI_COMM_WORLD, 1);
+            int count = 0;
+            for (int ky = -offset; ky <= offset; ky++)
+            {
+                const unsigned char *linha = src + (size_t)(y - srcY0 + ky) * w + (x - offset);
+                for (int kx = 0; kx <= 2 * offset; kx++)
+                    winB[count++] = linha[kx];
+            }
+            dst[x] = mediana(winB, window_size);
         }
-        printf("MPI iniciado com %d processos. Filtro: %dx%d\n", world_size, n_filter, n_filter);
+        return;
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
-    double start_time = MPI_Wtime();
+    for (int x = x0; x < x1; x++)
+    {
+        int count = 0;
+        for (int ky = -offset; ky <= offset; ky++)
+        {
+            const unsigned char *linha = src + ((size_t)(y - srcY0 + ky) * w + (x - offset)) * canais;
+            for (int kx = 0; kx <= 2 * offset; kx++)
+            {
+                winB[count] = linha[kx * canais];
+                winG[count] = linha[kx * canais + 1];
+                winR[count] = linha[kx * canais + 2];
+                count++;
+            }
+        }
 
-    MPI_Bcast(&w, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&h, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        dst[x * canais] = mediana(winB, window_size);
+        dst[x * canais + 1] = mediana(winG, window_size);
+        dst[x * canais + 2] = mediana(winR, window_size);
+        if (canais == 4)
+            dst[x * canais + 3] = src[((size_t)(y - srcY0) * w + x) * canais + 3];
+    }
+}
 
-    int rows_per_proc = h / world_size;
-    int remainder = h % world_size;
+// Maior N aceito: a janela (N * N bytes por canal) e os kernels SIMD, que contam os vizinhos
+// até N = 255, ficam limitados. Vale para a linha de comando e para o daemon.
+#define FILTRO_MAXIMO 255
 
-    int *sendcounts = NULL;
-    int *displs = NULL;
-    int *recvcounts_res = NULL;
-    int *displs_res = NULL;
+// Kernels especializados para N = 3, 5, 7 e 9. A janela é vista como N colunas
+// ordenadas: ao deslizar um pixel, só a coluna que entra é ordenada, e a mediana
+// sai de uma intercalação parcial das colunas em vez de um qsort completo.
+#define N_ESPECIALIZADO_MAX 9
 
-    if (world_rank == 0)
+static inline void carregaColuna(unsigned char *coluna, const unsigned char *src, int w, int yLocal, int x, int canais, int c, const int n)
+{
+    int offset = n / 2;
+    for (int k = 0; k < n; k++)
     {
-        sendcounts = (int *)malloc(world_size * sizeof(int));
-        displs = (int *)malloc(world_size * sizeof(int));
-        recvcounts_res = (int *)malloc(world_size * sizeof(int));
-        displs_res = (int *)malloc(world_size * sizeof(int));
-
-        int current_row = 0;
-        for (int i = 0; i < world_size; i++)
+        unsigned char v = src[((size_t)(yLocal - offset + k) * w + x) * canais + c];
+        int j = k;
+        while (j > 0 && coluna[j - 1] > v)
         {
-            int rows = rows_per_proc + (i < remainder ? 1 : 0);
+            coluna[j] = coluna[j - 1];
+            j--;
+        }
+        coluna[j] = v;
+    }
+}
 
-            recvcounts_res[i] = rows * w * 3;
-            displs_res[i] = current_row * w * 3;
+static inline unsigned char intercalaMediana(unsigned char colunas[][N_ESPECIALIZADO_MAX], const int n)
+{
+    int topo[N_ESPECIALIZADO_MAX] = {0};
+    unsigned char valor = 0;
 
-            int start_r = current_row - offset;
-            int end_r = current_row + rows + offset;
+    for (int k = 0; k <= n * n / 2; k++)
+    {
+        int menor = -1;
+        for (int j = 0; j < n; j++)
+        {
+            if (topo[j] < n && (menor < 0 || colunas[j][topo[j]] < colunas[menor][topo[menor]]))
+                menor = j;
+        }
+        valor = colunas[menor][topo[menor]++];
+    }
+    return valor;
+}
 
-            if (start_r < 0)
-                start_r = 0;
-            if (end_r > h)
-                end_r = h;
+static inline void medianaColunas(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais, const int n)
+{
+    int yLocal = y - srcY0;
+    int offset = n / 2;
+    int nCor = canais == 1 ? 1 : 3;
+    // [canal][coluna x % n][linha ordenada]
+    unsigned char colunas[3][N_ESPECIALIZADO_MAX][N_ESPECIALIZADO_MAX];
 
-            int rows_to_send = end_r - start_r;
-            sendcounts[i] = rows_to_send * w * 3;
-            displs[i] = start_r * w * 3;
+    for (int c = 0; c < nCor; c++)
+    {
+        for (int x = x0 - offset; x < x0 + offset; x++)
+            carregaColuna(colunas[c][x % n], src, w, yLocal, x, canais, c, n);
+    }
 
-            current_row += rows;
+    for (int x = x0; x < x1; x++)
+    {
+        for (int c = 0; c < nCor; c++)
+        {
+            carregaColuna(colunas[c][(x + offset) % n], src, w, yLocal, x + offset, canais, c, n);
+            dst[x * canais + c] = intercalaMediana(colunas[c], n);
         }
+        if (canais == 4)
+            dst[x * canais + 3] = src[((size_t)yLocal * w + x) * canais + 3];
     }
+}
 
-    int my_rows_output = rows_per_proc + (world_rank < remainder ? 1 : 0);
+void medianaInterior3(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais)
+{
+    medianaColunas(src, srcY0, dst, w, y, x0, x1, canais, 3);
+}
 
-    int my_start_global_y = 0;
-    for (int i = 0; i < world_rank; i++)
-        my_start_global_y += (rows_per_proc + (i < remainder ? 1 : 0));
+void medianaInterior5(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais)
+{
+    medianaColunas(src, srcY0, dst, w, y, x0, x1, canais, 5);
+}
 
-    int start_r_local = my_start_global_y - offset;
-    int end_r_local = my_start_global_y + my_rows_output + offset;
-    if (start_r_local < 0)
-        start_r_local = 0;
-    if (end_r_local > h)
-        end_r_local = h;
-    int my_rows_input = end_r_local - start_r_local;
+void medianaInterior7(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais)
+{
+    medianaColunas(src, srcY0, dst, w, y, x0, x1, canais, 7);
+}
 
-    unsigned char *local_input_buf = (unsigned char *)malloc(my_rows_input * w * 3);
+void medianaInterior9(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais)
+{
+    medianaColunas(src, srcY0, dst, w, y, x0, x1, canais, 9);
+}
 
-    MPI_Scatterv(full_img, sendcounts, displs, MPI_UNSIGNED_CHAR,
-                 local_input_buf, my_rows_input * w * 3, MPI_UNSIGNED_CHAR,
-                 0, MPI_COMM_WORLD);
+typedef void (*KernelMediana)(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais);
 
-    unsigned char *local_output_buf = (unsigned char *)malloc(my_rows_output * w * 3);
+// Indexada pelo offset (N / 2); tamanhos sem kernel próprio usam o caminho genérico
+KernelMediana tabelaMediana[N_ESPECIALIZADO_MAX / 2 + 1] = {
+    NULL, medianaInterior3, medianaInterior5, medianaInterior7, medianaInterior9};
 
-    int window_size = n_filter * n_filter;
-    unsigned char *winR = (unsigned char *)malloc(window_size);
-    unsigned char *winG = (unsigned char *)malloc(window_size);
-    unsigned char *winB = (unsigned char *)malloc(window_size);
+KernelMediana kernelMediana(int offset)
+{
+    if (offset < 0 || offset > N_ESPECIALIZADO_MAX / 2)
+        return NULL;
+    return tabelaMediana[offset];
+}
 
-    for (int y = 0; y < my_rows_output; y++)
-    {
-        int global_y = my_start_global_y + y;
+// Registro de kernels por conjunto de instruções. O mesmo corpo é compilado uma vez
+// por ISA (atributo target) e a variante é escolhida na inicialização via cpuid.
+#if defined(__x86_64__) || defined(__i386__)
+#define ISA_X86 1
+#endif
+
+#define SEMPRE_INLINE static inline __attribute__((always_inline))
+#define BLOCO_MEDIANA 64
 
-        int input_y_base = global_y - start_r_local;
+typedef enum
+{
+    ISA_ESCALAR,
+    ISA_SSE41,
+    ISA_AVX2,
+    ISA_AVX512,
+    ISA_TOTAL
+} Isa;
+
+const char *nomesIsa[ISA_TOTAL] = {"escalar", "sse4.1", "avx2", "avx512"};
+
+// Produtos 0.299 * r, 0.587 * g e 0.114 * b em double: somá-los na mesma ordem dá o
+// mesmo resultado da expressão original e não depende de contração em FMA
+double pesoR[256], pesoG[256], pesoB[256];
+
+// Mediana do miolo direto sobre os bytes intercalados: o vizinho kx de um byte está
+// kx * canais bytes adiante, então todos os canais são filtrados juntos. A mediana
+// (k-ésimo menor) é montada bit a bit contando quantos vizinhos ficam abaixo do
+// candidato, o que vetoriza sem desvios. A contagem em bytes vale até N = 15 (225 vizinhos).
+SEMPRE_INLINE void medianaBitsBloco(const unsigned char *src, unsigned char *dst, int rowSize, int yLocal, int i0, int canais, int n, const int len)
+{
+    int offset = n / 2;
+    int k = n * n / 2;
+    unsigned char m[BLOCO_MEDIANA], cand[BLOCO_MEDIANA], cont[BLOCO_MEDIANA];
 
-        for (int x = 0; x < w; x++)
+    for (int i = 0; i < len; i++)
+        m[i] = 0;
+
+    for (int bit = 7; bit >= 0; bit--)
+    {
+        for (int i = 0; i < len; i++)
         {
-            int out_idx = (y * w + x) * 3;
+            cand[i] = m[i] | (unsigned char)(1 << bit);
+            cont[i] = 0;
+        }
 
-            if (global_y < offset || global_y >= h - offset || x < offset || x >= w - offset)
+        for (int ky = -offset; ky <= offset; ky++)
+        {
+            for (int kx = -offset; kx <= offset; kx++)
             {
-                int in_idx = (input_y_base * w + x) * 3;
-                local_output_buf[out_idx] = local_input_buf[in_idx];
-                local_output_buf[out_idx + 1] = local_input_buf[in_idx + 1];
-                local_output_buf[out_idx + 2] = local_input_buf[in_idx + 2];
-                continue;
+                const unsigned char *p = src + (size_t)(yLocal + ky) * rowSize + i0 + kx * canais;
+                for (int i = 0; i < len; i++)
+                    cont[i] += p[i] < cand[i];
             }
+        }
 
-            int count = 0;
-            for (int ky = -offset; ky <= offset; ky++)
+        for (int i = 0; i < len; i++)
+            m[i] = cont[i] <= k ? cand[i] : m[i];
+    }
+
+    for (int i = 0; i < len; i++)
+        dst[i0 + i] = m[i];
+}
+
+// O mesmo para 17 <= N <= 255, em que a contagem passa de 255: ela segue em bytes, que
+// vetorizam melhor, mas é somada a total e zerada a cada 255 / N linhas da janela. Fica à
+// parte para não pesar nos registradores do caso comum.
+SEMPRE_INLINE void medianaBitsBlocoGrande(const unsigned char *src, unsigned char *dst, int rowSize, int yLocal, int i0, int canais, int n, const int len)
+{
+    int offset = n / 2;
+    uint32_t k = (uint32_t)n * n / 2;
+    int linhasPorVez = 255 / n;
+    unsigned char m[BLOCO_MEDIANA], cand[BLOCO_MEDIANA], cont[BLOCO_MEDIANA];
+    uint32_t total[BLOCO_MEDIANA];
+
+    for (int i = 0; i < len; i++)
+        m[i] = 0;
+
+    for (int bit = 7; bit >= 0; bit--)
+    {
+        for (int i = 0; i < len; i++)
+        {
+            cand[i] = m[i] | (unsigned char)(1 << bit);
+            cont[i] = 0;
+            total[i] = 0;
+        }
+
+        for (int ky0 = -offset; ky0 <= offset; ky0 += linhasPorVez)
+        {
+            int ky1 = ky0 + linhasPorVez - 1 < offset ? ky0 + linhasPorVez - 1 : offset;
+            for (int ky = ky0; ky <= ky1; ky++)
             {
                 for (int kx = -offset; kx <= offset; kx++)
                 {
-                    int ny = input_y_base + ky;
-                    int nx = x + kx;
-
-                    int in_idx = (ny * w + nx) * 3;
-                    winB[count] = local_input_buf[in_idx];
-                    winG[count] = local_input_buf[in_idx + 1];
-                    winR[count] = local_input_buf[in_idx + 2];
-                    count++;
+                    const unsigned char *p = src + (size_t)(yLocal + ky) * rowSize + i0 + kx * canais;
+                    for (int i = 0; i < len; i++)
+                        cont[i] += p[i] < cand[i];
                 }
             }
-
-            qsort(winB, window_size, sizeof(unsigned char), compare);
-            qsort(winG, window_size, sizeof(unsigned char), compare);
-            qsort(winR, window_size, sizeof(unsigned char), compare);
-
-            local_output_buf[out_idx] = winB[window_size / 2];
-            local_output_buf[out_idx + 1] = winG[window_size / 2];
-            local_output_buf[out_idx + 2] = winR[window_size / 2];
+            for (int i = 0; i < len; i++)
+            {
+                total[i] += cont[i];
+                cont[i] = 0;
+            }
         }
-    }
-
-    free(winR);
-    free(winG);
-    free(winB);
-    free(local_input_buf);
 
-    for (int i = 0; i < my_rows_output * w; i++)
-    {
-        int idx = i * 3;
-        unsigned char b = local_output_buf[idx];
-        unsigned char g = local_output_buf[idx + 1];
-        unsigned char r = local_output_buf[idx + 2];
+        for (int i = 0; i < len; i++)
+            m[i] = total[i] <= k ? cand[i] : m[i];
+    }
 
-        unsigned char gray = (unsigned char)(0.299 * r + 0.587 * g + 0.114 * b);
+    for (int i = 0; i < len; i++)
+        dst[i0 + i] = m[i];
+}
 
-        local_output_buf[idx] = gray;
-        local_output_buf[idx + 1] = gray;
-        local_output_buf[idx + 2] = gray;
-    }
+SEMPRE_INLINE void medianaBitsCorpo(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais, int n)
+{
+    int yLocal = y - srcY0;
+    int rowSize = w * canais;
+    int inicio = x0 * canais;
+    int fim = x1 * canais;
 
-    long local_hist[256] = {0};
-    for (int i = 0; i < my_rows_output * w; i++)
+    // Blocos de tamanho fixo (o último se sobrepõe ao anterior) para o laço vetorizar inteiro
+    if (fim - inicio < BLOCO_MEDIANA)
     {
-        local_hist[local_output_buf[i * 3]]++;
+        if (fim > inicio && n <= 15)
+            medianaBitsBloco(src, dst, rowSize, yLocal, inicio, canais, n, fim - inicio);
+        else if (fim > inicio)
+            medianaBitsBlocoGrande(src, dst, rowSize, yLocal, inicio, canais, n, fim - inicio);
     }
-
-    long global_hist[256] = {0};
-    MPI_Allreduce(local_hist, global_hist, 256, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
-
-    long cdf[256] = {0};
-    cdf[0] = global_hist[0];
-    for (int i = 1; i < 256; i++)
-        cdf[i] = cdf[i - 1] + global_hist[i];
-
-    long cdfMin = 0;
-    for (int i = 0; i < 256; i++)
+    else
     {
-        if (cdf[i] > 0)
+        for (int i0 = inicio; i0 < fim; i0 += BLOCO_MEDIANA)
         {
-            cdfMin = cdf[i];
-            break;
+            if (i0 + BLOCO_MEDIANA > fim)
+                i0 = fim - BLOCO_MEDIANA;
+            if (n <= 15)
+                medianaBitsBloco(src, dst, rowSize, yLocal, i0, canais, n, BLOCO_MEDIANA);
+            else
+                medianaBitsBlocoGrande(src, dst, rowSize, yLocal, i0, canais, n, BLOCO_MEDIANA);
         }
     }
 
-    unsigned char map[256];
-    long totalPixels = w * h;
-    for (int i = 0; i < 256; i++)
+    // O alfa não é filtrado
+    if (canais == 4)
     {
-        float num = (float)(cdf[i] - cdfMin);
+        for (int x = x0; x < x1; x++)
+            dst[x * 4 + 3] = src[((size_t)yLocal * w + x) * 4 + 3];
+    }
+}
+
+SEMPRE_INLINE void grayscaleCorpo(unsigned char *data, size_t totalPixels, int canais)
+{
+    for (size_t i = 0; i < totalPixels; i++)
+    {
+        unsigned char *p = data + i * canais;
+        unsigned char gray = (unsigned char)(pesoR[p[2]] + pesoG[p[1]] + pesoB[p[0]]);
+        p[0] = gray;
+        p[1] = gray;
+        p[2] = gray;
+    }
+}
+
+// Acumula em histogram; quatro tabelas parciais evitam a dependência entre
+// incrementos seguidos do mesmo nível. As parciais são de 32 bits, então a entrada é
+// contada em blocos de BLOCO_HISTOGRAMA pixels, que não as estouram.
+#define BLOCO_HISTOGRAMA ((size_t)1 << 30)
+
+SEMPRE_INLINE void histogramaCorpo(const unsigned char *data, size_t totalPixels, int canais, uint64_t *histogram)
+{
+    for (size_t inicio = 0; inicio < totalPixels; inicio += BLOCO_HISTOGRAMA)
+    {
+        const unsigned char *bloco = data + inicio * canais;
+        size_t n = totalPixels - inicio < BLOCO_HISTOGRAMA ? totalPixels - inicio : BLOCO_HISTOGRAMA;
+        uint32_t parcial[4][256];
+        memset(parcial, 0, sizeof(parcial));
+
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            parcial[0][bloco[i * canais]]++;
+            parcial[1][bloco[(i + 1) * canais]]++;
+            parcial[2][bloco[(i + 2) * canais]]++;
+            parcial[3][bloco[(i + 3) * canais]]++;
+        }
+        for (; i < n; i++)
+            parcial[0][bloco[i * canais]]++;
+
+        for (int v = 0; v < 256; v++)
+            histogram[v] += (uint64_t)parcial[0][v] + parcial[1][v] + parcial[2][v] + parcial[3][v];
+    }
+}
+
+SEMPRE_INLINE void aplicaLutCorpo(unsigned char *data, size_t totalPixels, int canais, const unsigned char *map)
+{
+    if (canais == 1)
+    {
+        for (size_t i = 0; i < totalPixels; i++)
+            data[i] = map[data[i]];
+        return;
+    }
+
+    for (size_t i = 0; i < totalPixels; i++)
+    {
+        unsigned char *p = data + i * canais;
+        unsigned char newVal = map[p[0]];
+        p[0] = newVal;
+        p[1] = newVal;
+        p[2] = newVal;
+    }
+}
+
+#define DEFINE_KERNELS(sufixo, alvo)                                                                       \
+    alvo void grayscale##sufixo(unsigned char *data, size_t totalPixels, int canais)                       \
+    {                                                                                                      \
+        grayscaleCorpo(data, totalPixels, canais);                                                         \
+    }                                                                                                      \
+    alvo void histograma##sufixo(const unsigned char *data, size_t totalPixels, int canais,                \
+                                 uint64_t *histogram)                                                      \
+    {                                                                                                      \
+        histogramaCorpo(data, totalPixels, canais, histogram);                                             \
+    }                                                                                                      \
+    alvo void aplicaLut##sufixo(unsigned char *data, size_t totalPixels, int canais,                       \
+                                const unsigned char *map)                                                  \
+    {                                                                                                      \
+        aplicaLutCorpo(data, totalPixels, canais, map);                                                    \
+    }
+
+// A mediana escalar continua sendo a dos kernels por colunas ordenadas
+#define DEFINE_MEDIANA(sufixo, alvo)                                                                       \
+    alvo void medianaBits##sufixo(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y,  \
+                                  int x0, int x1, int canais, int n)                                       \
+    {                                                                                                      \
+        medianaBitsCorpo(src, srcY0, dst, w, y, x0, x1, canais, n);                                        \
+    }
+
+DEFINE_KERNELS(Escalar, )
+#ifdef ISA_X86
+DEFINE_KERNELS(SSE41, __attribute__((target("sse4.1"))))
+DEFINE_KERNELS(AVX2, __attribute__((target("avx2"))))
+DEFINE_KERNELS(AVX512, __attribute__((target("avx512f,avx512bw"))))
+DEFINE_MEDIANA(SSE41, __attribute__((target("sse4.1"))))
+DEFINE_MEDIANA(AVX2, __attribute__((target("avx2"))))
+DEFINE_MEDIANA(AVX512, __attribute__((target("avx512f,avx512bw"))))
+#endif
+
+typedef struct
+{
+    Isa isa;
+    // NULL: usa os kernels por colunas ordenadas (ou o qsort genérico)
+    void (*mediana)(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais, int n);
+    void (*grayscale)(unsigned char *data, size_t totalPixels, int canais);
+    void (*histograma)(const unsigned char *data, size_t totalPixels, int canais, uint64_t *histogram);
+    void (*aplicaLut)(unsigned char *data, size_t totalPixels, int canais, const unsigned char *map);
+} Kernels;
+
+Kernels kernels = {ISA_ESCALAR, NULL, grayscaleEscalar, histogramaEscalar, aplicaLutEscalar};
+
+int isaSuportada(Isa isa)
+{
+    if (isa == ISA_ESCALAR)
+        return 1;
+#ifdef ISA_X86
+    __builtin_cpu_init();
+    if (isa == ISA_SSE41)
+        return __builtin_cpu_supports("sse4.1");
+    if (isa == ISA_AVX2)
+        return __builtin_cpu_supports("avx2");
+    if (isa == ISA_AVX512)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+    return 0;
+}
+
+int leIsa(const char *nome, Isa *isa)
+{
+    for (int i = 0; i < ISA_TOTAL; i++)
+    {
+        if (strcmp(nome, nomesIsa[i]) == 0)
+        {
+            *isa = (Isa)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+Isa melhorIsa()
+{
+    for (int i = ISA_TOTAL - 1; i > ISA_ESCALAR; i--)
+    {
+        if (isaSuportada((Isa)i))
+            return (Isa)i;
+    }
+    return ISA_ESCALAR;
+}
+
+// Retorna 0 se a CPU não suporta a ISA pedida
+int selecionaKernels(Isa isa)
+{
+    if (!isaSuportada(isa))
+        return 0;
+
+    for (int i = 0; i < 256; i++)
+    {
+        pesoR[i] = 0.299 * i;
+        pesoG[i] = 0.587 * i;
+        pesoB[i] = 0.114 * i;
+    }
+
+    Kernels escolhidos = {ISA_ESCALAR, NULL, grayscaleEscalar, histogramaEscalar, aplicaLutEscalar};
+#ifdef ISA_X86
+    if (isa == ISA_SSE41)
+        escolhidos = (Kernels){isa, medianaBitsSSE41, grayscaleSSE41, histogramaSSE41, aplicaLutSSE41};
+    else if (isa == ISA_AVX2)
+        escolhidos = (Kernels){isa, medianaBitsAVX2, grayscaleAVX2, histogramaAVX2, aplicaLutAVX2};
+    else if (isa == ISA_AVX512)
+        escolhidos = (Kernels){isa, medianaBitsAVX512, grayscaleAVX512, histogramaAVX512, aplicaLutAVX512};
+#endif
+    kernels = escolhidos;
+    return 1;
+}
+
+// Pixels próximos da borda: a janela é completada conforme o modo escolhido
+void medianaBorda(const unsigned char *src, int srcY0, unsigned char *dst, int w, int h, int y, int x0, int x1, int offset, int canais,
+                  ModoBorda modo, unsigned char valorBorda,
+                  unsigned char *winB, unsigned char *winG, unsigned char *winR)
+{
+    int window_size = (2 * offset + 1) * (2 * offset + 1);
+
+    for (int x = x0; x < x1; x++)
+    {
+        size_t center_idx = ((size_t)(y - srcY0) * w + x) * canais;
+
+        if (modo == BORDA_COPIAR)
+        {
+            memcpy(&dst[x * canais], &src[center_idx], canais);
+            continue;
+        }
+
+        int count = 0;
+        for (int ky = -offset; ky <= offset; ky++)
+        {
+            int ny = indiceBorda(y + ky, h, modo);
+            for (int kx = -offset; kx <= offset; kx++)
+            {
+                int nx = indiceBorda(x + kx, w, modo);
+                if (ny < 0 || nx < 0)
+                {
+                    winB[count] = valorBorda;
+                    winG[count] = valorBorda;
+                    winR[count] = valorBorda;
+                }
+                else
+                {
+                    size_t in_idx = ((size_t)(ny - srcY0) * w + nx) * canais;
+                    winB[count] = src[in_idx];
+                    if (canais > 1)
+                    {
+                        winG[count] = src[in_idx + 1];
+                        winR[count] = src[in_idx + 2];
+                    }
+                }
+                count++;
+            }
+        }
+
+        dst[x * canais] = mediana(winB, window_size);
+        if (canais > 1)
+        {
+            dst[x * canais + 1] = mediana(winG, window_size);
+            dst[x * canais + 2] = mediana(winR, window_size);
+        }
+        if (canais == 4)
+            dst[x * canais + 3] = src[center_idx + 3];
+    }
+}
+
+// Regiões planas (--plano): a saída é dividida em blocos de LADO_PLANO x LADO_PLANO pixels a
+// partir da linha y0, e um resumo marca os blocos em que cada canal de cor varia no máximo
+// toleranciaPlano níveis em toda a vizinhança que as janelas dos seus pixels alcançam (o bloco
+// mais offset de cada lado). Ali a mediana não ordena nada: com tolerância 0 ela é o próprio
+// pixel central, que é copiado; acima de 0 a cópia fica a no máximo toleranciaPlano níveis
+// dela. Só o interior é pulado, então as bordas seguem o modo de borda normalmente.
+#define LADO_PLANO 32
+
+typedef struct
+{
+    unsigned char *plano; // Um por bloco, em ordem de linha
+    int y0;
+    int blocosX;
+    int blocosY;
+} Planos;
+
+int toleranciaPlano = -1; // -1: desligado
+uint64_t blocosPlanos = 0, blocosTotal = 0;
+double tempoPlanos = 0; // Gasto montando os resumos
+
+// Se cada canal de cor do retângulo [x0, x1) x [y0, y1) varia até tolerancia; para no
+// primeiro pixel que passa dela, então blocos com textura custam poucas leituras
+static int retanguloPlano(const unsigned char *src, int srcY0, int w, int x0, int x1, int y0, int y1, int canais,
+                          int tolerancia)
+{
+    int cores = canais == 4 ? 3 : canais;
+    const unsigned char *primeiro = src + ((size_t)(y0 - srcY0) * w + x0) * canais;
+    int minimo[3], maximo[3];
+    for (int c = 0; c < cores; c++)
+        minimo[c] = maximo[c] = primeiro[c];
+
+    for (int y = y0; y < y1; y++)
+    {
+        const unsigned char *linha = src + ((size_t)(y - srcY0) * w + x0) * canais;
+        for (int x = 0; x < x1 - x0; x++)
+        {
+            for (int c = 0; c < cores; c++)
+            {
+                int v = linha[x * canais + c];
+                if (v < minimo[c])
+                    minimo[c] = v;
+                if (v > maximo[c])
+                    maximo[c] = v;
+                if (maximo[c] - minimo[c] > tolerancia)
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Resumo das linhas de saída [y0, y1); src precisa ter também as offset linhas de cada lado
+Planos *marcaPlanos(const unsigned char *src, int srcY0, int w, int h, int y0, int y1, int offset, int canais)
+{
+    double inicio = MPI_Wtime();
+    Planos *p = (Planos *)malloc(sizeof(Planos));
+    p->y0 = y0;
+    p->blocosX = (w + LADO_PLANO - 1) / LADO_PLANO;
+    p->blocosY = (y1 - y0 + LADO_PLANO - 1) / LADO_PLANO;
+    p->plano = (unsigned char *)malloc((size_t)p->blocosX * p->blocosY);
+
+    uint64_t planos = 0;
+    for (int by = 0; by < p->blocosY; by++)
+    {
+        int ry0 = y0 + by * LADO_PLANO - offset;
+        int ry1 = (y0 + (by + 1) * LADO_PLANO < y1 ? y0 + (by + 1) * LADO_PLANO : y1) + offset;
+        if (ry0 < 0)
+            ry0 = 0;
+        if (ry1 > h)
+            ry1 = h;
+        for (int bx = 0; bx < p->blocosX; bx++)
+        {
+            int rx0 = bx * LADO_PLANO - offset < 0 ? 0 : bx * LADO_PLANO - offset;
+            int rx1 = (bx + 1) * LADO_PLANO + offset > w ? w : (bx + 1) * LADO_PLANO + offset;
+            int plano = retanguloPlano(src, srcY0, w, rx0, rx1, ry0, ry1, canais, toleranciaPlano);
+            p->plano[(size_t)by * p->blocosX + bx] = (unsigned char)plano;
+            planos += plano;
+        }
+    }
+    blocosPlanos += planos;
+    blocosTotal += (uint64_t)p->blocosX * p->blocosY;
+    tempoPlanos += MPI_Wtime() - inicio;
+    return p;
+}
+
+void liberaPlanos(Planos *p)
+{
+    if (!p)
+        return;
+    free(p->plano);
+    free(p);
+}
+
+// A economia estimada supõe que cada bloco copiado custaria o mesmo que um ordenado e
+// desconta o tempo de montar o resumo; pode sair negativa em imagens sem regiões planas
+void imprimePlanos(uint64_t planos, uint64_t total, double resumo, double mediana)
+{
+    double economia = planos < total ? mediana * planos / (total - planos) - resumo : 0.0;
+    printf("Regioes planas: %llu de %llu blocos (%.1f%%) copiados sem ordenar; resumo %.4f s, mediana %.4f s, "
+           "economia estimada %.4f s\n",
+           (unsigned long long)planos, (unsigned long long)total, total ? 100.0 * planos / total : 0.0, resumo, mediana,
+           economia);
+}
+
+// Soma os blocos e os tempos de todos os processos e mostra no 0; a mediana inclui o resto
+// do trabalho de cada processo (cinza e histograma)
+void relataPlanos(int rank, double tempoTrabalho)
+{
+    uint64_t meus[2] = {blocosPlanos, blocosTotal}, soma[2];
+    double meusTempos[2] = {tempoPlanos, tempoTrabalho}, tempos[2];
+    MPI_Reduce(meus, soma, 2, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(meusTempos, tempos, 2, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (rank == 0)
+        imprimePlanos(soma[0], soma[1], tempos[0], tempos[1] - tempos[0]);
+}
+
+// O interior [x0, x1) da linha y, pelo kernel mais rápido disponível
+static inline void medianaTrecho(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1,
+                                 int offset, int canais, unsigned char *winB, unsigned char *winG, unsigned char *winR)
+{
+    // Os kernels SIMD contam os vizinhos até N = 255
+    KernelMediana kernel = kernelMediana(offset);
+    if (kernels.mediana && offset <= 127)
+        kernels.mediana(src, srcY0, dst, w, y, x0, x1, canais, 2 * offset + 1);
+    else if (kernel)
+        kernel(src, srcY0, dst, w, y, x0, x1, canais);
+    else
+        medianaInterior(src, srcY0, dst, w, y, x0, x1, offset, canais, winB, winG, winR);
+}
+
+// Filtra a linha global y: as colunas de borda e o miolo são tratados por kernels separados.
+// planos pode ser NULL; com ele, os trechos de blocos planos do interior são só copiados
+void filtraLinha(const unsigned char *src, int srcY0, unsigned char *dst, int w, int h, int y, int offset, int canais,
+                 ModoBorda modo, unsigned char valorBorda,
+                 unsigned char *winB, unsigned char *winG, unsigned char *winR, const Planos *planos)
+{
+    if (y < offset || y >= h - offset || w <= 2 * offset)
+    {
+        medianaBorda(src, srcY0, dst, w, h, y, 0, w, offset, canais, modo, valorBorda, winB, winG, winR);
+        return;
+    }
+
+    medianaBorda(src, srcY0, dst, w, h, y, 0, offset, offset, canais, modo, valorBorda, winB, winG, winR);
+
+    int x1 = w - offset;
+    if (!planos)
+        medianaTrecho(src, srcY0, dst, w, y, offset, x1, offset, canais, winB, winG, winR);
+    else
+    {
+        // Blocos seguidos do mesmo tipo vão num trecho só
+        const unsigned char *linhaPlanos = planos->plano + (size_t)((y - planos->y0) / LADO_PLANO) * planos->blocosX;
+        int x = offset;
+        while (x < x1)
+        {
+            int plano = linhaPlanos[x / LADO_PLANO];
+            int fim = (x / LADO_PLANO + 1) * LADO_PLANO;
+            while (fim < x1 && linhaPlanos[fim / LADO_PLANO] == plano)
+                fim += LADO_PLANO;
+            if (fim > x1)
+                fim = x1;
+            if (plano)
+                memcpy(dst + x * canais, src + ((size_t)(y - srcY0) * w + x) * canais, (size_t)(fim - x) * canais);
+            else
+                medianaTrecho(src, srcY0, dst, w, y, x, fim, offset, canais, winB, winG, winR);
+            x = fim;
+        }
+    }
+
+    medianaBorda(src, srcY0, dst, w, h, y, x1, w, offset, canais, modo, valorBorda, winB, winG, winR);
+}
+
+// Filtra as linhas globais [y0, y1) de buf no próprio lugar; buf começa na linha global bufY0.
+// Só as N linhas originais da janela ficam guardadas, num anel em que cada linha é gravada
+// em duas posições (j % N e j % N + N): assim as N linhas estão sempre contíguas e os
+// kernels leem o anel como se fosse a imagem. acima/abaixo são cópias das linhas de halo
+// fora de [y0, y1) quando outra thread pode sobrescrevê-las; NULL lê direto de buf.
+void medianaNoLugar(unsigned char *buf, int bufY0, int y0, int y1, const unsigned char *acima, const unsigned char *abaixo,
+                    int w, int h, int n_filter, int canais, ModoBorda modo, unsigned char valorBorda,
+                    unsigned char *winB, unsigned char *winG, unsigned char *winR, const Planos *planos)
+{
+    int offset = n_filter / 2;
+    int linhasAnel = 2 * offset + 1;
+    int rowSize = w * canais;
+    int primeira = y0 - offset < 0 ? 0 : y0 - offset;
+    unsigned char *anel = (unsigned char *)alocaBuffer((size_t)2 * linhasAnel * rowSize);
+
+    int proxima = primeira;
+    for (int y = y0; y < y1; y++)
+    {
+        int fim = y + offset + 1 > h ? h : y + offset + 1;
+        for (; proxima < fim; proxima++)
+        {
+            const unsigned char *original;
+            if (proxima < y0 && acima)
+                original = acima + (size_t)(proxima - primeira) * rowSize;
+            else if (proxima >= y1 && abaixo)
+                original = abaixo + (size_t)(proxima - y1) * rowSize;
+            else
+                original = buf + (size_t)(proxima - bufY0) * rowSize;
+
+            int slot = proxima % linhasAnel;
+            memcpy(anel + slot * rowSize, original, rowSize);
+            memcpy(anel + (slot + linhasAnel) * rowSize, original, rowSize);
+        }
+
+        int topo = y - offset < 0 ? 0 : y - offset;
+        filtraLinha(anel + (topo % linhasAnel) * rowSize, topo, buf + (size_t)(y - bufY0) * rowSize, w, h, y, offset, canais,
+                    modo, valorBorda, winB, winG, winR, planos);
+    }
+
+    liberaBuffer(anel);
+}
+
+void mapaEqualizacao(const uint64_t *histogram, uint64_t totalPixels, unsigned char *map)
+{
+    uint64_t cdf[256] = {0};
+    cdf[0] = histogram[0];
+    for (int i = 1; i < 256; i++)
+        cdf[i] = cdf[i - 1] + histogram[i];
+
+    uint64_t cdfMin = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        if (cdf[i] > 0)
+        {
+            cdfMin = cdf[i];
+            break;
+        }
+    }
+
+    for (int i = 0; i < 256; i++)
+    {
+        // Sem sinal, cdf[i] - cdfMin daria a volta abaixo do primeiro nível presente
+        if (cdf[i] <= cdfMin)
+        {
+            map[i] = 0;
+            continue;
+        }
+        float num = (float)(cdf[i] - cdfMin);
         float den = (float)(totalPixels - cdfMin);
         int val = (int)round((num / den) * 255.0);
         if (val < 0)
@@ -345,37 +1219,1335 @@ int main(int argc, char *argv[])
             val = 255;
         map[i] = (unsigned char)val;
     }
+}
+
+// Simula um nó mais lento ou compartilhado: depois de um trecho de trabalho que levou
+// duracao segundos, o processo dorme mais (fator - 1) vezes esse tempo
+void atrasaProcesso(double duracao, double fator)
+{
+    if (fator <= 1)
+        return;
+    double espera = duracao * (fator - 1);
+    struct timespec ts;
+    ts.tv_sec = (time_t)espera;
+    ts.tv_nsec = (long)((espera - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+#define TAG_PEDIDO 1
+#define TAG_FAIXA 2
+#define TAG_DADOS 3
+#define TAG_RESULTADO 4
+#define TAG_RLE 5
+#define LINHAS_FAIXA 32
+
+// As contagens do MPI são int: as faixas viajam em linhas inteiras (um tipo contíguo de
+// w * canais bytes) e o que não tem tamanho de linha, como o RLE8, em blocos de BLOCO_MPI bytes
+#ifndef BLOCO_MPI
+#define BLOCO_MPI ((size_t)1 << 30)
+#endif
+
+MPI_Datatype tipoLinha(int rowSize)
+{
+    MPI_Datatype tipo;
+    MPI_Type_contiguous(rowSize, MPI_UNSIGNED_CHAR, &tipo);
+    MPI_Type_commit(&tipo);
+    return tipo;
+}
+
+void enviaEmBlocos(const unsigned char *buf, size_t n, int destino, int tag, MPI_Comm comm)
+{
+    for (size_t i = 0; i < n; i += BLOCO_MPI)
+        MPI_Send(buf + i, (int)(n - i < BLOCO_MPI ? n - i : BLOCO_MPI), MPI_UNSIGNED_CHAR, destino, tag, comm);
+}
+
+void recebeEmBlocos(unsigned char *buf, size_t n, int origem, int tag, MPI_Comm comm)
+{
+    for (size_t i = 0; i < n; i += BLOCO_MPI)
+        MPI_Recv(buf + i, (int)(n - i < BLOCO_MPI ? n - i : BLOCO_MPI), MPI_UNSIGNED_CHAR, origem, tag, comm,
+                 MPI_STATUS_IGNORE);
+}
 
-    for (int i = 0; i < my_rows_output * w; i++)
+// Escalonamento dinâmico: o processo 0 só distribui trabalho. Cada trabalhador pede uma faixa
+// de linhas, recebe as linhas dela com o halo, filtra e converte, e devolve a faixa junto com
+// o histograma parcial; a devolução já vale como pedido da próxima faixa, então quem termina
+// antes pega mais. O mestre soma os histogramas parciais em histogram.
+void mestreDinamico(const unsigned char *entrada, unsigned char *saida, int w, int h, int canais, int offset,
+                    int linhasFaixa, int world_size, uint64_t *histogram)
+{
+    size_t rowSize = (size_t)w * canais;
+    MPI_Datatype linha = tipoLinha(w * canais);
+    int *faixaAtual = (int *)malloc(world_size * sizeof(int)); // Primeira linha da faixa com cada trabalhador
+    for (int i = 0; i < world_size; i++)
+        faixaAtual[i] = -1;
+
+    int proxima = 0;
+    int ativos = world_size - 1;
+    while (ativos > 0)
     {
-        int idx = i * 3;
-        unsigned char oldVal = local_output_buf[idx];
-        unsigned char newVal = map[oldVal];
-        local_output_buf[idx] = newVal;
-        local_output_buf[idx + 1] = newVal;
-        local_output_buf[idx + 2] = newVal;
+        uint64_t hist[256];
+        MPI_Status status;
+        MPI_Recv(hist, 256, MPI_UINT64_T, MPI_ANY_SOURCE, TAG_PEDIDO, MPI_COMM_WORLD, &status);
+        int origem = status.MPI_SOURCE;
+
+        if (faixaAtual[origem] >= 0)
+        {
+            int y0 = faixaAtual[origem];
+            int linhas = h - y0 < linhasFaixa ? h - y0 : linhasFaixa;
+            MPI_Recv(saida + (size_t)y0 * rowSize, linhas, linha, origem, TAG_RESULTADO, MPI_COMM_WORLD,
+                     MPI_STATUS_IGNORE);
+            for (int v = 0; v < 256; v++)
+                histogram[v] += hist[v];
+        }
+
+        int faixa[2] = {-1, -1};
+        if (proxima < h)
+        {
+            faixa[0] = proxima;
+            faixa[1] = h - proxima < linhasFaixa ? h : proxima + linhasFaixa;
+            proxima = faixa[1];
+        }
+        else
+            ativos--;
+        faixaAtual[origem] = faixa[0];
+
+        MPI_Send(faixa, 2, MPI_INT, origem, TAG_FAIXA, MPI_COMM_WORLD);
+        if (faixa[0] >= 0)
+        {
+            int topo = faixa[0] - offset < 0 ? 0 : faixa[0] - offset;
+            int base = faixa[1] + offset > h ? h : faixa[1] + offset;
+            MPI_Send(entrada + (size_t)topo * rowSize, base - topo, linha, origem, TAG_DADOS, MPI_COMM_WORLD);
+        }
     }
 
-    MPI_Gatherv(local_output_buf, my_rows_output * w * 3, MPI_UNSIGNED_CHAR,
-                full_img, recvcounts_res, displs_res, MPI_UNSIGNED_CHAR,
-                0, MPI_COMM_WORLD);
+    MPI_Type_free(&linha);
+    free(faixaAtual);
+}
 
-    MPI_Barrier(MPI_COMM_WORLD);
-    double end_time = MPI_Wtime();
+// Lado do trabalhador; devolve quantas linhas processou e soma em tempoTrabalho o tempo gasto
+int trabalhadorDinamico(int w, int h, int canais, int n_filter, int linhasFaixa, int inPlace, ModoBorda borda,
+                        unsigned char valorBorda, double fatorLento, double *tempoTrabalho)
+{
+    int offset = n_filter / 2;
+    size_t rowSize = (size_t)w * canais;
+    MPI_Datatype linha = tipoLinha(w * canais);
+    unsigned char *entrada = (unsigned char *)alocaBuffer((size_t)(linhasFaixa + 2 * offset) * rowSize);
+    unsigned char *saida = inPlace ? NULL : (unsigned char *)alocaBuffer((size_t)linhasFaixa * rowSize);
 
-    if (world_rank == 0)
+    int window_size = n_filter * n_filter;
+    int passo = (window_size + ALINHAMENTO_BUFFER - 1) / ALINHAMENTO_BUFFER * ALINHAMENTO_BUFFER;
+    unsigned char *janelas = (unsigned char *)alocaBuffer(3 * passo);
+    unsigned char *winR = janelas;
+    unsigned char *winG = janelas + passo;
+    unsigned char *winB = janelas + 2 * passo;
+
+    uint64_t hist[256] = {0};
+    unsigned char *resultado = NULL;
+    int linhasResultado = 0;
+    int linhasFeitas = 0;
+    while (1)
     {
-        printf("Tempo Total: %.6f s\n", end_time - start_time);
-        writeBMP("output_mpi.bmp", w, h, full_img, bmpHead, bmpInfo);
-        printf("Imagem salva em output_mpi.bmp\n");
-        free(full_img);
-        free(sendcounts);
-        free(displs);
-        free(recvcounts_res);
-        free(displs_res);
+        MPI_Send(hist, 256, MPI_UINT64_T, 0, TAG_PEDIDO, MPI_COMM_WORLD);
+        if (resultado)
+            MPI_Send(resultado, linhasResultado, linha, 0, TAG_RESULTADO, MPI_COMM_WORLD);
+
+        int faixa[2];
+        MPI_Recv(faixa, 2, MPI_INT, 0, TAG_FAIXA, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if (faixa[0] < 0)
+            break;
+        int topo = faixa[0] - offset < 0 ? 0 : faixa[0] - offset;
+        int base = faixa[1] + offset > h ? h : faixa[1] + offset;
+        MPI_Recv(entrada, base - topo, linha, 0, TAG_DADOS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+        double inicio = MPI_Wtime();
+        Planos *planos = toleranciaPlano >= 0 ? marcaPlanos(entrada, topo, w, h, faixa[0], faixa[1], offset, canais) : NULL;
+        if (inPlace)
+        {
+            medianaNoLugar(entrada, topo, faixa[0], faixa[1], NULL, NULL, w, h, n_filter, canais, borda, valorBorda,
+                           winB, winG, winR, planos);
+            resultado = entrada + (faixa[0] - topo) * rowSize;
+        }
+        else
+        {
+            for (int y = faixa[0]; y < faixa[1]; y++)
+                filtraLinha(entrada, topo, saida + (y - faixa[0]) * rowSize, w, h, y, offset, canais,
+                            borda, valorBorda, winB, winG, winR, planos);
+            resultado = saida;
+        }
+        liberaPlanos(planos);
+        linhasResultado = faixa[1] - faixa[0];
+
+        if (canais > 1)
+            kernels.grayscale(resultado, (size_t)linhasResultado * w, canais);
+        memset(hist, 0, sizeof(hist));
+        kernels.histograma(resultado, (size_t)linhasResultado * w, canais, hist);
+
+        atrasaProcesso(MPI_Wtime() - inicio, fatorLento);
+        *tempoTrabalho += MPI_Wtime() - inicio;
+        linhasFeitas += linhasResultado;
+    }
+
+    MPI_Type_free(&linha);
+    liberaBuffer(janelas);
+    liberaBuffer(entrada);
+    if (saida)
+        liberaBuffer(saida);
+    return linhasFeitas;
+}
+
+// Modo luma: converte para cinza e separa um canal só, que é o que viaja e passa pela mediana
+unsigned char *separaCinza(unsigned char *cor, int w, int h, int canais)
+{
+    kernels.grayscale(cor, (size_t)w * h, canais);
+    unsigned char *cinza = (unsigned char *)alocaBuffer((size_t)w * h);
+    for (size_t i = 0; i < (size_t)w * h; i++)
+        cinza[i] = cor[i * canais];
+    return cinza;
+}
+
+// O cinza volta para B, G e R da imagem original, que mantém o alfa
+void devolveCinza(unsigned char *cor, const unsigned char *cinza, int w, int h, int canais)
+{
+    for (size_t i = 0; i < (size_t)w * h; i++)
+        cor[i * canais] = cor[i * canais + 1] = cor[i * canais + 2] = cinza[i];
+}
+
+// Divisão estática: cada processo de comm filtra uma faixa de linhas igual (mais o halo), e o
+// histograma é somado entre todos antes da LUT. No processo 0 de comm, full_img é a imagem
+// inteira e volta equalizada, ou, com rle8, rle recebe o RLE8 completo. Com MPI_COMM_SELF é
+// o pipeline inteiro num processo só, sem comunicação.
+void divisaoEstatica(MPI_Comm comm, unsigned char *full_img, int w, int h, int canais, int topDown, int n_filter,
+                     int inPlace, ModoBorda borda, unsigned char valorBorda, int rle8, double fator,
+                     uint64_t *global_hist, unsigned char **rle, size_t *tamanhoRle, double *tempoTrabalho,
+                     int *linhasProcessadas)
+{
+    int rank, nprocs;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nprocs);
+    int offset = n_filter / 2;
+
+    int rows_per_proc = h / nprocs;
+    int remainder = h % nprocs;
+
+    int *sendcounts = NULL;
+    int *displs = NULL;
+    int *recvcounts_res = NULL;
+    int *displs_res = NULL;
+
+    if (rank == 0)
+    {
+        sendcounts = (int *)malloc(nprocs * sizeof(int));
+        displs = (int *)malloc(nprocs * sizeof(int));
+        recvcounts_res = (int *)malloc(nprocs * sizeof(int));
+        displs_res = (int *)malloc(nprocs * sizeof(int));
+
+        int current_row = 0;
+        for (int i = 0; i < nprocs; i++)
+        {
+            int rows = rows_per_proc + (i < remainder ? 1 : 0);
+
+            recvcounts_res[i] = rows;
+            displs_res[i] = current_row;
+
+            int start_r = current_row - offset;
+            int end_r = current_row + rows + offset;
+
+            if (start_r < 0)
+                start_r = 0;
+            if (end_r > h)
+                end_r = h;
+
+            int rows_to_send = end_r - start_r;
+            sendcounts[i] = rows_to_send;
+            displs[i] = start_r;
+
+            current_row += rows;
+        }
+    }
+
+    int my_rows_output = rows_per_proc + (rank < remainder ? 1 : 0);
+
+    int my_start_global_y = 0;
+    for (int i = 0; i < rank; i++)
+        my_start_global_y += (rows_per_proc + (i < remainder ? 1 : 0));
+
+    int start_r_local = my_start_global_y - offset;
+    int end_r_local = my_start_global_y + my_rows_output + offset;
+    if (start_r_local < 0)
+        start_r_local = 0;
+    if (end_r_local > h)
+        end_r_local = h;
+    int my_rows_input = end_r_local - start_r_local;
+
+    // Contagens e deslocamentos em linhas. O processo 0 não copia a própria faixa: filtra
+    // direto na imagem inteira (MPI_IN_PLACE), o que poupa uma cópia dela com um processo só
+    size_t rowSize = (size_t)w * canais;
+    MPI_Datatype linha = tipoLinha(w * canais);
+    unsigned char *local_input_buf;
+    if (rank == 0)
+    {
+        local_input_buf = full_img + (size_t)start_r_local * rowSize;
+        MPI_Scatterv(full_img, sendcounts, displs, linha, MPI_IN_PLACE, my_rows_input, linha, 0, comm);
+    }
+    else
+    {
+        local_input_buf = (unsigned char *)alocaBuffer((size_t)my_rows_input * rowSize);
+        MPI_Scatterv(NULL, NULL, NULL, linha, local_input_buf, my_rows_input, linha, 0, comm);
+    }
+
+    // As três janelas num só buffer, cada uma numa linha de cache própria
+    int window_size = n_filter * n_filter;
+    int passo = (window_size + ALINHAMENTO_BUFFER - 1) / ALINHAMENTO_BUFFER * ALINHAMENTO_BUFFER;
+    unsigned char *janelas = (unsigned char *)alocaBuffer(3 * passo);
+    unsigned char *winR = janelas;
+    unsigned char *winG = janelas + passo;
+    unsigned char *winB = janelas + 2 * passo;
+
+    double inicioTrabalho = MPI_Wtime();
+    Planos *planos = toleranciaPlano >= 0 ? marcaPlanos(local_input_buf, start_r_local, w, h, my_start_global_y,
+                                                        my_start_global_y + my_rows_output, offset, canais)
+                                          : NULL;
+    unsigned char *local_output_buf;
+    if (inPlace)
+    {
+        // As linhas de saída ficam dentro do próprio buffer de entrada
+        medianaNoLugar(local_input_buf, start_r_local, my_start_global_y, my_start_global_y + my_rows_output, NULL, NULL,
+                       w, h, n_filter, canais, borda, valorBorda, winB, winG, winR, planos);
+        local_output_buf = local_input_buf + (size_t)(my_start_global_y - start_r_local) * rowSize;
+    }
+    else
+    {
+        local_output_buf = (unsigned char *)alocaBuffer((size_t)my_rows_output * rowSize);
+        for (int y = 0; y < my_rows_output; y++)
+        {
+            filtraLinha(local_input_buf, start_r_local, local_output_buf + (size_t)y * rowSize, w, h, my_start_global_y + y, offset, canais,
+                        borda, valorBorda, winB, winG, winR, planos);
+        }
+        // O halo do processo 0 é a imagem inteira; as faixas dos outros já foram enviadas,
+        // então a saída dele pode voltar para o lugar
+        if (rank == 0)
+        {
+            memcpy(full_img, local_output_buf, (size_t)my_rows_output * rowSize);
+            liberaBuffer(local_output_buf);
+            local_output_buf = full_img;
+        }
+        else
+            liberaBuffer(local_input_buf);
+    }
+
+    liberaPlanos(planos);
+    liberaBuffer(janelas);
+
+    // 8 bits já está em tons de cinza
+    if (canais > 1)
+        kernels.grayscale(local_output_buf, (size_t)my_rows_output * w, canais);
+
+    uint64_t local_hist[256] = {0};
+    kernels.histograma(local_output_buf, (size_t)my_rows_output * w, canais, local_hist);
+    atrasaProcesso(MPI_Wtime() - inicioTrabalho, fator);
+    *tempoTrabalho = MPI_Wtime() - inicioTrabalho;
+    *linhasProcessadas = my_rows_output;
+
+    MPI_Allreduce(local_hist, global_hist, 256, MPI_UINT64_T, MPI_SUM, comm);
+
+    unsigned char map[256];
+    mapaEqualizacao(global_hist, (uint64_t)w * h, map);
+
+    kernels.aplicaLut(local_output_buf, (size_t)my_rows_output * w, canais, map);
+
+    if (rle8)
+    {
+        // Cada processo codifica a própria faixa e só o RLE8 vai para o processo 0, que
+        // concatena as faixas na ordem do arquivo (de baixo para cima: invertida se top-down).
+        // O total pode passar de 2 GB, então cada faixa vem em blocos ponto a ponto.
+        unsigned char *rleLocal = (unsigned char *)alocaBuffer(LIMITE_RLE8(w) * my_rows_output);
+        uint64_t tamanhoLocal = codificaRle8(local_output_buf, w, canais, 0, my_rows_output, topDown, rleLocal);
+
+        uint64_t *tamanhos = NULL;
+        if (rank == 0)
+            tamanhos = (uint64_t *)malloc(nprocs * sizeof(uint64_t));
+        MPI_Gather(&tamanhoLocal, 1, MPI_UINT64_T, tamanhos, 1, MPI_UINT64_T, 0, comm);
+
+        if (rank == 0)
+        {
+            for (int r = 0; r < nprocs; r++)
+                *tamanhoRle += tamanhos[r];
+            *rle = (unsigned char *)alocaBuffer(*tamanhoRle + 2);
+
+            size_t pos = 0;
+            for (int k = 0; k < nprocs; k++)
+            {
+                int r = topDown ? nprocs - 1 - k : k;
+                if (r == 0)
+                    memcpy(*rle + pos, rleLocal, tamanhoLocal);
+                else
+                    recebeEmBlocos(*rle + pos, tamanhos[r], r, TAG_RLE, comm);
+                pos += tamanhos[r];
+            }
+            (*rle)[(*tamanhoRle)++] = 0;
+            (*rle)[(*tamanhoRle)++] = 1; // Fim do bitmap
+            free(tamanhos);
+        }
+        else
+            enviaEmBlocos(rleLocal, tamanhoLocal, 0, TAG_RLE, comm);
+        liberaBuffer(rleLocal);
+    }
+    else if (rank == 0)
+    {
+        MPI_Gatherv(MPI_IN_PLACE, my_rows_output, linha, full_img, recvcounts_res, displs_res, linha, 0, comm);
+    }
+    else
+    {
+        MPI_Gatherv(local_output_buf, my_rows_output, linha, NULL, NULL, NULL, linha, 0, comm);
+    }
+
+    MPI_Type_free(&linha);
+
+    if (rank == 0)
+    {
+        free(sendcounts);
+        free(displs);
+        free(recvcounts_res);
+        free(displs_res);
+    }
+    else
+    {
+        if (inPlace)
+            liberaBuffer(local_input_buf);
+        else
+            liberaBuffer(local_output_buf);
+    }
+}
+
+// Teste de imagem grande (--teste-grande LxA[xC]): o processo 0 gera blocos de LADO_BLOCO x
+// LADO_BLOCO pixels com um nível dominante; 1 bloco em cada 256, espalhados em x e em y, e o
+// último bloco do buffer têm níveis que dependem da posição e do canal, então um erro de
+// endereçamento em qualquer eixo aparece. A contagem do dominante passa de 32 bits com sinal
+// a partir de cerca de 2^31 pixels. Com N < LADO_BLOCO a janela toca no máximo 2x2 blocos e a
+// mediana esperada sai de quantos pixels de cada um ela cobre. A imagem segue o caminho normal
+// (distribuição, Allreduce, coleta) e no fim é conferida contra o histograma exato e o mapa
+// esperado, pixel a pixel, em vez de gravada.
+#define LADO_BLOCO 16
+
+// O último bloco de cada eixo absorve o resto, para nenhum ficar mais estreito que a janela
+int numBlocos(int tamanho)
+{
+    return tamanho / LADO_BLOCO > 0 ? tamanho / LADO_BLOCO : 1;
+}
+
+int blocoTeste(int p, int tamanho)
+{
+    int b = p / LADO_BLOCO;
+    return b < numBlocos(tamanho) ? b : numBlocos(tamanho) - 1;
+}
+
+unsigned char nivelBloco(int w, int h, int bx, int by, int c)
+{
+    unsigned int posicao = (unsigned int)bx * 7 + (unsigned int)by * 13;
+    int ultimo = bx == numBlocos(w) - 1 && by == numBlocos(h) - 1;
+    if (posicao % 256 != 0 && !ultimo)
+        return 128;
+    return (unsigned char)(20 + (posicao / 256 + 37 * c) % 100);
+}
+
+// Mediana do canal c no pixel (x, y) com borda copiar. A janela cobre no máximo 2x2 blocos:
+// nx0 das suas colunas e ny0 das linhas caem nos primeiros (a borda repete a primeira e a
+// última), e a mediana é o menor nível que acumula mais da metade da janela.
+unsigned char medianaBlocos(int w, int h, int x, int y, int c, int raio)
+{
+    int lado = 2 * raio + 1;
+    int bx0 = blocoTeste(x - raio < 0 ? 0 : x - raio, w), bx1 = blocoTeste(x + raio >= w ? w - 1 : x + raio, w);
+    int by0 = blocoTeste(y - raio < 0 ? 0 : y - raio, h), by1 = blocoTeste(y + raio >= h ? h - 1 : y + raio, h);
+    int nx0 = bx0 == bx1 ? lado : bx1 * LADO_BLOCO - (x - raio);
+    int ny0 = by0 == by1 ? lado : by1 * LADO_BLOCO - (y - raio);
+
+    unsigned char v[4] = {nivelBloco(w, h, bx0, by0, c), nivelBloco(w, h, bx1, by0, c),
+                          nivelBloco(w, h, bx0, by1, c), nivelBloco(w, h, bx1, by1, c)};
+    int n[4] = {nx0 * ny0, (lado - nx0) * ny0, nx0 * (lado - ny0), (lado - nx0) * (lado - ny0)};
+    int mediana = 256;
+    for (int i = 0; i < 4; i++)
+    {
+        int ate = 0;
+        for (int j = 0; j < 4; j++)
+        {
+            if (v[j] <= v[i])
+                ate += n[j];
+        }
+        if (n[i] > 0 && ate > lado * lado / 2 && v[i] < mediana)
+            mediana = v[i];
+    }
+    return (unsigned char)mediana;
+}
+
+// Cinza esperado no pixel (x, y), pela mesma expressão do kernel
+unsigned char cinzaBlocos(int w, int h, int canais, int x, int y, int raio)
+{
+    unsigned char b = medianaBlocos(w, h, x, y, 0, raio);
+    if (canais == 1)
+        return b;
+    return (unsigned char)(pesoR[medianaBlocos(w, h, x, y, 2, raio)] + pesoG[medianaBlocos(w, h, x, y, 1, raio)] + pesoB[b]);
+}
+
+// Bloco da linha y quando a janela não sai dele na vertical (linhas assim no mesmo bloco
+// saem iguais), ou -1 quando ela pega dois blocos
+int linhaSimples(int h, int raio, int y)
+{
+    int y0 = y - raio < 0 ? 0 : y - raio;
+    int y1 = y + raio >= h ? h - 1 : y + raio;
+    return blocoTeste(y0, h) == blocoTeste(y1, h) ? blocoTeste(y, h) : -1;
+}
+
+// Cinza esperado de toda a linha y: o nível de cada bloco, menos perto dos cantos, onde a
+// janela pega 2x2 blocos e nenhum deles tem maioria
+void cinzaLinhaBlocos(int w, int h, int canais, int raio, int y, unsigned char *cinza)
+{
+    int nbx = numBlocos(w);
+    for (int bx = 0; bx < nbx; bx++)
+    {
+        int x0 = bx * LADO_BLOCO;
+        int x1 = bx == nbx - 1 ? w : x0 + LADO_BLOCO;
+        memset(cinza + x0, cinzaBlocos(w, h, canais, x0, y, 0), x1 - x0);
+    }
+
+    if (linhaSimples(h, raio, y) >= 0)
+        return;
+    for (int bx = 1; bx < nbx; bx++)
+    {
+        for (int x = bx * LADO_BLOCO - raio; x < bx * LADO_BLOCO + raio; x++)
+            cinza[x] = cinzaBlocos(w, h, canais, x, y, raio);
+    }
+}
+
+// Preenche a linha y da imagem de teste; o alfa fica em 255
+void linhaBlocos(int w, int h, int canais, int y, unsigned char *linha)
+{
+    int nbx = numBlocos(w);
+    int by = blocoTeste(y, h);
+    for (int bx = 0; bx < nbx; bx++)
+    {
+        int x0 = bx * LADO_BLOCO;
+        int x1 = bx == nbx - 1 ? w : x0 + LADO_BLOCO;
+        unsigned char nivel[4] = {nivelBloco(w, h, bx, by, 0), nivelBloco(w, h, bx, by, 1), nivelBloco(w, h, bx, by, 2), 255};
+        if (canais == 1)
+            memset(linha + x0, nivel[0], x1 - x0);
+        else
+        {
+            for (int x = x0; x < x1; x++)
+                memcpy(linha + (size_t)x * canais, nivel, canais);
+        }
+    }
+}
+
+// Linha de saída esperada: o mapa aplicado ao cinza em todos os canais, com o alfa em 255
+void saidaLinhaBlocos(const unsigned char *cinza, int w, int canais, const unsigned char *mapa, unsigned char *saida)
+{
+    for (int x = 0; x < w; x++)
+    {
+        for (int c = 0; c < canais; c++)
+            saida[(size_t)x * canais + c] = c == 3 ? 255 : mapa[cinza[x]];
+    }
+}
+
+unsigned char *imagemBlocos(int w, int h, int canais)
+{
+    unsigned char *data = (unsigned char *)alocaBuffer((size_t)w * h * canais);
+    if (!data)
+        return NULL;
+
+    size_t rowSize = (size_t)w * canais;
+    for (int y = 0; y < h; y++)
+        linhaBlocos(w, h, canais, y, data + (size_t)y * rowSize);
+    return data;
+}
+
+// Retorna quantas conferências falharam
+int verificaBlocos(const unsigned char *data, int w, int h, int canais, int raio, const uint64_t *histogram)
+{
+    // Referência: o cinza esperado de cada pixel, contado linha a linha. Linhas simples do
+    // mesmo bloco repetem a anterior.
+    size_t rowSize = (size_t)w * canais;
+    unsigned char *cinza = (unsigned char *)malloc(w);
+    unsigned char *certo = (unsigned char *)malloc(rowSize);
+    uint64_t esperado[256] = {0};
+    uint64_t contagemLinha[256];
+    int anterior = -1;
+    for (int y = 0; y < h; y++)
+    {
+        int chave = linhaSimples(h, raio, y);
+        if (chave < 0 || chave != anterior)
+        {
+            cinzaLinhaBlocos(w, h, canais, raio, y, cinza);
+            memset(contagemLinha, 0, sizeof(contagemLinha));
+            for (int x = 0; x < w; x++)
+                contagemLinha[cinza[x]]++;
+        }
+        anterior = chave;
+        for (int v = 0; v < 256; v++)
+            esperado[v] += contagemLinha[v];
+    }
+
+    int falhas = 0;
+    int dominante = 0;
+    for (int v = 0; v < 256; v++)
+    {
+        if (histogram[v] != esperado[v])
+        {
+            printf("  histograma[%d] = %llu, esperado %llu\n", v, (unsigned long long)histogram[v], (unsigned long long)esperado[v]);
+            falhas++;
+        }
+        if (esperado[v] > esperado[dominante])
+            dominante = v;
+    }
+
+    unsigned char mapaEsperado[256];
+    mapaEqualizacao(esperado, (uint64_t)w * h, mapaEsperado);
+    anterior = -1;
+    for (int y = 0; y < h && falhas < 10; y++)
+    {
+        int chave = linhaSimples(h, raio, y);
+        if (chave < 0 || chave != anterior)
+        {
+            cinzaLinhaBlocos(w, h, canais, raio, y, cinza);
+            saidaLinhaBlocos(cinza, w, canais, mapaEsperado, certo);
+        }
+        anterior = chave;
+        const unsigned char *linha = data + (size_t)y * rowSize;
+        if (memcmp(linha, certo, rowSize) != 0)
+        {
+            size_t i = 0;
+            while (linha[i] == certo[i])
+                i++;
+            printf("  pixel (%zu, %d) canal %zu = %d, esperado %d\n", i / canais, y, i % canais, linha[i], certo[i]);
+            falhas++;
+        }
+    }
+    free(cinza);
+    free(certo);
+
+    printf("  nivel dominante %d: %llu pixels (%s 2^31)\n", dominante, (unsigned long long)esperado[dominante],
+           esperado[dominante] > INT32_MAX ? "acima de" : "abaixo de");
+    return falhas;
+}
+
+// Modo lote (--lote): muitas imagens numa execução. Dividir uma imagem pequena em faixas
+// gasta mais em Scatterv/Allreduce/Gatherv do que na mediana, então cada imagem vai inteira
+// para um processo, que a lê, filtra e grava sozinho, sem comunicação. Só as imagens grandes
+// demais para isso são divididas em faixas entre todos. O modelo de custo, por imagem:
+//   inteira = custoPixel * pixels * canais filtrados
+//   faixas  = inteira / P + 2 * bytes * (P - 1) / P / banda + 7 * latencia
+// custoPixel é medido no processo 0 com o filtro escolhido, banda e latência por ping-pong
+// entre os processos 0 e 1. Da mais cara para a mais barata, uma imagem vai em faixas quando,
+// sozinha, custa mais do que a parte justa de um processo nas imagens que ainda vão inteiras
+// (ela definiria o tempo total) e faixas sai mais barato que inteira; a primeira que cabe na
+// parte justa encerra as faixas. --limite-lote MPIXELS troca o modelo por um limite fixo.
+typedef struct
+{
+    const char *entrada;
+    int w, h, canais;
+    double inteira; // Segundos estimados num processo só
+    double faixas;  // Segundos estimados em faixas entre todos
+    int processo;   // Quem processa a imagem inteira, -1 para faixas ou -2 se ilegível
+} ItemLote;
+
+// Segundos por pixel e canal da mediana, num bloco sintético de 3 canais
+double calibraMediana(int n_filter, ModoBorda borda, unsigned char valorBorda)
+{
+    int w = 1024, h = 64, canais = 3;
+    int offset = n_filter / 2;
+    size_t rowSize = (size_t)w * canais;
+    unsigned char *bloco = (unsigned char *)alocaBuffer((size_t)h * rowSize);
+    unsigned char *linha = (unsigned char *)alocaBuffer(rowSize);
+    unsigned int semente = 12345;
+    for (size_t i = 0; i < (size_t)h * rowSize; i++)
+    {
+        semente = semente * 1103515245 + 12345;
+        bloco[i] = (unsigned char)(semente >> 16);
+    }
+
+    int window_size = n_filter * n_filter;
+    int passo = (window_size + ALINHAMENTO_BUFFER - 1) / ALINHAMENTO_BUFFER * ALINHAMENTO_BUFFER;
+    unsigned char *janelas = (unsigned char *)alocaBuffer(3 * passo);
+
+    // Repete até passar de 20 ms, para o tempo não ficar na resolução do relógio
+    int passadas = 0;
+    double inicio = MPI_Wtime();
+    do
+    {
+        for (int y = 0; y < h; y++)
+            filtraLinha(bloco, 0, linha, w, h, y, offset, canais, borda, valorBorda, janelas + 2 * passo,
+                        janelas + passo, janelas, NULL);
+        passadas++;
+    } while (MPI_Wtime() - inicio < 0.02);
+    double custo = (MPI_Wtime() - inicio) / ((double)passadas * w * h * canais);
+
+    liberaBuffer(janelas);
+    liberaBuffer(linha);
+    liberaBuffer(bloco);
+    return custo;
+}
+
+// Latência e banda entre os processos 0 e 1, por ping-pong; os outros só esperam o resultado
+void calibraRede(int rank, double *banda, double *latencia)
+{
+    int tamanho = 4 * 1024 * 1024;
+    int voltas = 10;
+    unsigned char *buf = (unsigned char *)alocaBuffer(tamanho);
+    memset(buf, 0, tamanho);
+    double medidas[2] = {0, 0};
+
+    for (int k = 0; k < 2 && rank < 2; k++)
+    {
+        int n = k == 0 ? 1 : tamanho;
+        double inicio = MPI_Wtime();
+        for (int v = 0; v < voltas; v++)
+        {
+            if (rank == 0)
+            {
+                MPI_Send(buf, n, MPI_UNSIGNED_CHAR, 1, TAG_DADOS, MPI_COMM_WORLD);
+                MPI_Recv(buf, n, MPI_UNSIGNED_CHAR, 1, TAG_DADOS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            }
+            else
+            {
+                MPI_Recv(buf, n, MPI_UNSIGNED_CHAR, 0, TAG_DADOS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                MPI_Send(buf, n, MPI_UNSIGNED_CHAR, 0, TAG_DADOS, MPI_COMM_WORLD);
+            }
+        }
+        medidas[k] = (MPI_Wtime() - inicio) / (2 * voltas);
+    }
+    MPI_Bcast(medidas, 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    *latencia = medidas[0];
+    double transferencia = medidas[1] - medidas[0];
+    *banda = tamanho / (transferencia > 1e-9 ? transferencia : 1e-9);
+    liberaBuffer(buf);
+}
+
+int comparaCusto(const void *a, const void *b)
+{
+    double ca = (*(const ItemLote *const *)a)->inteira;
+    double cb = (*(const ItemLote *const *)b)->inteira;
+    return (ca < cb) - (ca > cb);
+}
+
+// Decide quem processa cada item. As imagens em faixas vão para todos; as inteiras, da mais
+// cara para a mais barata, para o processo com menos carga até ali.
+void planejaLote(ItemLote *itens, int n, int nprocs, double custoPixel, double banda, double latencia, int luma,
+                 double limitePixels)
+{
+    ItemLote **ordem = (ItemLote **)malloc(n * sizeof(ItemLote *));
+    double restante = 0;
+    for (int i = 0; i < n; i++)
+    {
+        ItemLote *it = &itens[i];
+        int canaisMediana = luma || it->canais == 1 ? 1 : 3;
+        int canaisTransporte = luma ? 1 : it->canais;
+        double pixels = (double)it->w * it->h;
+        double bytes = pixels * canaisTransporte;
+        it->inteira = custoPixel * pixels * canaisMediana;
+        it->faixas = it->inteira / nprocs + 2 * bytes * (nprocs - 1) / nprocs / banda + 7 * latencia;
+        restante += it->inteira;
+        ordem[i] = it;
+    }
+    qsort(ordem, n, sizeof(ItemLote *), comparaCusto);
+
+    double *carga = (double *)calloc(nprocs, sizeof(double));
+    int faixasAbertas = nprocs > 1;
+    for (int i = 0; i < n; i++)
+    {
+        ItemLote *it = ordem[i];
+        if (it->w == 0)
+        {
+            it->processo = -2;
+            continue;
+        }
+        int emFaixas = 0;
+        if (faixasAbertas && limitePixels >= 0)
+            emFaixas = (double)it->w * it->h > limitePixels;
+        else if (faixasAbertas)
+        {
+            emFaixas = it->inteira > restante / nprocs && it->faixas < it->inteira;
+            faixasAbertas = emFaixas;
+        }
+
+        if (emFaixas)
+        {
+            it->processo = -1;
+            restante -= it->inteira;
+            continue;
+        }
+        int menor = 0;
+        for (int p = 1; p < nprocs; p++)
+        {
+            if (carga[p] < carga[menor])
+                menor = p;
+        }
+        it->processo = menor;
+        carga[menor] += it->inteira;
+    }
+
+    free(carga);
+    free(ordem);
+}
+
+// Uma imagem do lote, do arquivo ao arquivo, dividida entre os processos de comm; com
+// MPI_COMM_SELF o processo faz tudo sozinho. Retorna 0 se a entrada não pôde ser lida.
+int processaArquivo(MPI_Comm comm, const char *entrada, const char *saida, int n_filter, int inPlace,
+                    ModoBorda borda, unsigned char valorBorda, int rle8, int luma, double *tempoTrabalho)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    int dims[4] = {0, 0, 0, 0}; // Largura, altura, canais, topDown
+    unsigned char *img = NULL;
+    BMPHeader head;
+    BMPInfoHeader info;
+    if (rank == 0)
+    {
+        img = leBitMap(entrada, &dims[0], &dims[1], &head, &info);
+        if (img)
+        {
+            dims[2] = info.biBitCount / 8;
+            dims[3] = info.biHeight < 0;
+        }
+        else
+            dims[0] = 0;
+    }
+    MPI_Bcast(dims, 4, MPI_INT, 0, comm);
+    if (dims[0] == 0)
+        return 0;
+    int w = dims[0], h = dims[1], canais = dims[2], topDown = dims[3];
+
+    unsigned char *cor = NULL;
+    if (luma && canais > 1)
+    {
+        if (rank == 0)
+        {
+            cor = img;
+            img = separaCinza(cor, w, h, canais);
+        }
+    }
+    int canaisFiltro = luma ? 1 : canais;
+
+    uint64_t hist[256] = {0};
+    unsigned char *rle = NULL;
+    size_t tamanhoRle = 0;
+    double tempo = 0;
+    int linhas = 0;
+    divisaoEstatica(comm, img, w, h, canaisFiltro, topDown, n_filter, inPlace, borda, valorBorda, rle8, 1, hist, &rle,
+                    &tamanhoRle, &tempo, &linhas);
+    *tempoTrabalho += tempo;
+
+    if (rank == 0)
+    {
+        if (cor)
+        {
+            if (!rle8)
+                devolveCinza(cor, img, w, h, canais);
+            liberaBuffer(img);
+            img = cor;
+        }
+        if (rle8)
+        {
+            escreveBitMapRle8(saida, h, rle, tamanhoRle, head, info);
+            liberaBuffer(rle);
+        }
+        else
+            escreveBitMap(saida, w, h, img, head, info);
+        liberaBuffer(img);
+    }
+    return 1;
+}
+
+// Nome de saída: eq_<nome da entrada> dentro de pasta
+void nomeSaidaLote(const char *entrada, const char *pasta, char *saida, size_t tamanho)
+{
+    const char *nome = strrchr(entrada, '/');
+    snprintf(saida, tamanho, "%s/eq_%s", pasta, nome ? nome + 1 : entrada);
+}
+
+int executaLote(char **entradas, int n, const char *pasta, int n_filter, int inPlace, ModoBorda borda,
+                unsigned char valorBorda, int rle8, int luma, double limitePixels)
+{
+    int rank, nprocs;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+
+    ItemLote *itens = (ItemLote *)calloc(n, sizeof(ItemLote));
+    int *processo = (int *)malloc(n * sizeof(int));
+    double banda = 0, latencia = 0;
+    if (nprocs > 1)
+        calibraRede(rank, &banda, &latencia);
+
+    if (rank == 0)
+    {
+        double custoPixel = calibraMediana(n_filter, borda, valorBorda);
+        for (int i = 0; i < n; i++)
+        {
+            itens[i].entrada = entradas[i];
+            if (!dimensoesBitMap(entradas[i], &itens[i].w, &itens[i].h, &itens[i].canais))
+                printf("Erro ao ler %s; ignorada.\n", entradas[i]);
+        }
+        planejaLote(itens, n, nprocs, custoPixel, banda, latencia, luma, limitePixels);
+
+        printf("Lote: %d imagens, %d processos. Filtro: %dx%d Kernels: %s\n", n, nprocs, n_filter, n_filter,
+               nomesIsa[kernels.isa]);
+        if (nprocs > 1)
+            printf("Modelo: mediana %.2f ns/pixel/canal, banda %.0f MB/s, latencia %.1f us\n", custoPixel * 1e9,
+                   banda / 1e6, latencia * 1e6);
+        for (int i = 0; i < n; i++)
+        {
+            processo[i] = itens[i].processo;
+            if (processo[i] < 0 && itens[i].w > 0)
+                printf("  %s %dx%d em faixas (estimado: inteira %.1f ms, faixas %.1f ms)\n", itens[i].entrada,
+                       itens[i].w, itens[i].h, itens[i].inteira * 1e3, itens[i].faixas * 1e3);
+        }
+    }
+    MPI_Bcast(processo, n, MPI_INT, 0, MPI_COMM_WORLD);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double inicio = MPI_Wtime();
+
+    // Primeiro as imagens em faixas, com todos juntos; depois cada um segue com as suas
+    char saida[4096];
+    int falhas = 0;
+    for (int i = 0; i < n && rank == 0; i++)
+        falhas += processo[i] == -2;
+    int minhas = 0;
+    double tempoTrabalho = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (processo[i] != -1)
+            continue;
+        nomeSaidaLote(entradas[i], pasta, saida, sizeof(saida));
+        falhas += !processaArquivo(MPI_COMM_WORLD, entradas[i], saida, n_filter, inPlace, borda, valorBorda, rle8, luma,
+                                   &tempoTrabalho);
+    }
+    double fimFaixas = MPI_Wtime();
+    for (int i = 0; i < n; i++)
+    {
+        if (processo[i] != rank)
+            continue;
+        nomeSaidaLote(entradas[i], pasta, saida, sizeof(saida));
+        falhas += !processaArquivo(MPI_COMM_SELF, entradas[i], saida, n_filter, inPlace, borda, valorBorda, rle8, luma,
+                                   &tempoTrabalho);
+        minhas++;
+    }
+    double meus[2] = {MPI_Wtime() - inicio, tempoTrabalho};
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double total = MPI_Wtime() - inicio;
+
+    double *tempos = NULL;
+    int *contagens = NULL;
+    if (rank == 0)
+    {
+        tempos = (double *)malloc(2 * nprocs * sizeof(double));
+        contagens = (int *)malloc(nprocs * sizeof(int));
+    }
+    MPI_Gather(meus, 2, MPI_DOUBLE, tempos, 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Gather(&minhas, 1, MPI_INT, contagens, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    int falhasTotal = 0;
+    MPI_Reduce(&falhas, &falhasTotal, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (rank == 0)
+    {
+        printf("Tempo Total: %.6f s (faixas %.6f s)\n", total, fimFaixas - inicio);
+        for (int p = 0; p < nprocs; p++)
+            printf("  Processo %d: %d imagens inteiras, terminou em %.6f s, %.6f s de trabalho\n", p, contagens[p],
+                   tempos[2 * p], tempos[2 * p + 1]);
+        if (falhasTotal)
+            printf("%d imagens nao puderam ser lidas.\n", falhasTotal);
+        printf("Imagens salvas em %s/\n", pasta);
+        free(tempos);
+        free(contagens);
+    }
+    if (toleranciaPlano >= 0)
+        relataPlanos(rank, tempoTrabalho);
+
+    free(processo);
+    free(itens);
+    return falhasTotal ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    MPI_Init(&argc, &argv);
+
+    int world_rank, world_size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+    if (argc < 2)
+    {
+        if (world_rank == 0)
+            printf("Uso: mpirun -np X %s <tamanho_filtro_N> [--entrada arquivo.bmp] [--saida arquivo.bmp]\n"
+                   "       [--borda copiar|replicar|refletir|constante] [--valor-borda V]\n"
+                   "       [--isa escalar|sse4.1|avx2|avx512] [--in-place] [--sem-pool] [--rle8] [--luma]\n"
+                   "       [--dinamico] [--linhas-faixa N] [--lento RANK:FATOR] [--teste-grande LxA[xC]]\n"
+                   "       [--lote arquivo.bmp... [--pasta-saida DIR] [--limite-lote MPIXELS]]\n"
+                   "       [--plano] [--tolerancia-plano T]\n", argv[0]);
+        MPI_Finalize();
+        return 1;
+    }
+
+    int n_filter = atoi(argv[1]);
+    if (n_filter < 1 || n_filter > FILTRO_MAXIMO)
+    {
+        if (world_rank == 0)
+            printf("Tamanho de filtro invalido: %s (use 1 a %d)\n", argv[1], FILTRO_MAXIMO);
+        MPI_Finalize();
+        return 1;
+    }
+    if (n_filter % 2 == 0)
+        n_filter++;
+    int offset = n_filter / 2;
+
+    const char *inputFilename = "../bitmaps/small.bmp";
+    const char *outputFilename = "output_mpi.bmp";
+    ModoBorda borda = BORDA_COPIAR;
+    unsigned char valorBorda = 0;
+    Isa isa = melhorIsa();
+    int inPlace = 0;
+    int rle8 = 0;
+    int luma = 0;
+    int dinamico = 0;
+    int plano = 0;
+    int linhasFaixa = LINHAS_FAIXA;
+    int rankLento = -1;
+    double fatorLento = 1;
+    int testeW = 0, testeH = 0, testeCanais = 1;
+    char **lote = NULL;
+    int nLote = 0;
+    const char *pastaSaida = ".";
+    double limiteLote = -1;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--borda") == 0 && i + 1 < argc)
+        {
+            if (!leModoBorda(argv[++i], &borda))
+            {
+                if (world_rank == 0)
+                    printf("Modo de borda invalido: %s (use copiar, replicar, refletir ou constante)\n", argv[i]);
+                MPI_Finalize();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--valor-borda") == 0 && i + 1 < argc)
+        {
+            valorBorda = (unsigned char)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--in-place") == 0)
+        {
+            inPlace = 1;
+        }
+        else if (strcmp(argv[i], "--sem-pool") == 0)
+        {
+            poolAtivo = 0;
+        }
+        else if (strcmp(argv[i], "--rle8") == 0)
+        {
+            rle8 = 1;
+        }
+        else if (strcmp(argv[i], "--luma") == 0)
+        {
+            luma = 1;
+        }
+        else if (strcmp(argv[i], "--dinamico") == 0)
+        {
+            dinamico = 1;
+        }
+        else if (strcmp(argv[i], "--plano") == 0)
+        {
+            plano = 1;
+        }
+        else if (strcmp(argv[i], "--tolerancia-plano") == 0 && i + 1 < argc)
+        {
+            toleranciaPlano = atoi(argv[++i]);
+            if (toleranciaPlano < 0 || toleranciaPlano > 255)
+            {
+                if (world_rank == 0)
+                    printf("Tolerancia invalida: %s (use 0 a 255)\n", argv[i]);
+                MPI_Finalize();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--linhas-faixa") == 0 && i + 1 < argc)
+        {
+            linhasFaixa = atoi(argv[++i]);
+            if (linhasFaixa < 1)
+                linhasFaixa = 1;
+        }
+        else if (strcmp(argv[i], "--lento") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%d:%lf", &rankLento, &fatorLento) != 2 || fatorLento < 1)
+            {
+                if (world_rank == 0)
+                    printf("Formato invalido para --lento: %s (use RANK:FATOR, com FATOR >= 1)\n", argv[i]);
+                MPI_Finalize();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--teste-grande") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%dx%d", &testeW, &testeH, &testeCanais) < 2 || testeW <= 0 || testeH <= 0 ||
+                (testeCanais != 1 && testeCanais != 3 && testeCanais != 4) || n_filter >= LADO_BLOCO)
+            {
+                if (world_rank == 0)
+                    printf("Teste invalido: %s (use LARGURAxALTURA[xCANAIS], canais 1, 3 ou 4, filtro menor que %d)\n",
+                           argv[i], LADO_BLOCO);
+                MPI_Finalize();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--lote") == 0)
+        {
+            // As entradas vão até a próxima opção
+            lote = argv + i + 1;
+            while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0)
+            {
+                i++;
+                nLote++;
+            }
+        }
+        else if (strcmp(argv[i], "--pasta-saida") == 0 && i + 1 < argc)
+        {
+            pastaSaida = argv[++i];
+        }
+        else if (strcmp(argv[i], "--limite-lote") == 0 && i + 1 < argc)
+        {
+            limiteLote = atof(argv[++i]) * 1e6;
+        }
+        else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+        {
+            if (!leIsa(argv[++i], &isa))
+            {
+                if (world_rank == 0)
+                    printf("ISA invalida: %s (use escalar, sse4.1, avx2 ou avx512)\n", argv[i]);
+                MPI_Finalize();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--entrada") == 0 && i + 1 < argc)
+        {
+            inputFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--saida") == 0 && i + 1 < argc)
+        {
+            outputFilename = argv[++i];
+        }
+        else
+        {
+            if (world_rank == 0)
+                printf("Opcao desconhecida: %s\n", argv[i]);
+            MPI_Finalize();
+            return 1;
+        }
+    }
+
+    // Cada processo detecta a própria CPU: nós diferentes podem usar ISAs diferentes
+    if (!selecionaKernels(isa))
+    {
+        printf("Processo %d: ISA '%s' nao suportada por esta CPU.\n", world_rank, nomesIsa[isa]);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    double meuFator = world_rank == rankLento ? fatorLento : 1;
+    if (plano && toleranciaPlano < 0)
+        toleranciaPlano = 0;
+
+    // Com um processo só não há trabalhador para o mestre
+    if (dinamico && world_size < 2)
+    {
+        if (world_rank == 0)
+            printf("--dinamico precisa de pelo menos 2 processos; usando a divisao estatica.\n");
+        dinamico = 0;
+    }
+
+    if (lote)
+    {
+        if (nLote == 0 || dinamico || testeW > 0)
+        {
+            if (world_rank == 0)
+                printf("--lote precisa de pelo menos uma entrada e nao combina com --dinamico nem --teste-grande.\n");
+            MPI_Finalize();
+            return 1;
+        }
+        int r = executaLote(lote, nLote, pastaSaida, n_filter, inPlace, borda, valorBorda, rle8, luma, limiteLote);
+        liberaPool();
+        MPI_Finalize();
+        return r;
+    }
+
+    // O teste confere a imagem coletada; com RLE8 o processo 0 só teria o arquivo comprimido
+    if (testeW > 0)
+    {
+        if (world_rank == 0 && (rle8 || luma || borda == BORDA_CONSTANTE))
+            printf("--teste-grande ignora --rle8 e --luma e usa a borda copiar.\n");
+        rle8 = 0;
+        luma = 0;
+        borda = BORDA_COPIAR;
+    }
+
+    int w, h, canais, topDown;
+    unsigned char *full_img = NULL;
+    BMPHeader bmpHead;
+    BMPInfoHeader bmpInfo;
+
+    if (world_rank == 0 && testeW > 0)
+    {
+        w = testeW;
+        h = testeH;
+        bmpInfo.biBitCount = testeCanais * 8;
+        bmpInfo.biHeight = h;
+        full_img = imagemBlocos(w, h, testeCanais);
+        if (!full_img)
+        {
+            printf("Memoria insuficiente para o teste.\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        printf("Teste grande: %dx%d, %d canal(is), %.2f Gpixels, %.2f GB\n", w, h, testeCanais, (double)w * h / 1e9,
+               (double)w * h * testeCanais / 1e9);
+    }
+    if (world_rank == 0)
+    {
+        if (testeW == 0)
+            full_img = leBitMap(inputFilename, &w, &h, &bmpHead, &bmpInfo);
+        if (!full_img)
+        {
+            printf("Erro ao ler %s\n", inputFilename);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        printf("MPI iniciado com %d processos. Filtro: %dx%d Kernels: %s\n", world_size, n_filter, n_filter, nomesIsa[kernels.isa]);
+        if (dinamico)
+            printf("Escalonamento dinamico: faixas de %d linhas, processo 0 como mestre\n", linhasFaixa);
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start_time = MPI_Wtime();
+
+    MPI_Bcast(&w, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&h, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (world_rank == 0)
+    {
+        canais = bmpInfo.biBitCount / 8;
+        topDown = bmpInfo.biHeight < 0;
+    }
+    MPI_Bcast(&canais, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&topDown, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    // Modo luma: o processo 0 converte para cinza antes de distribuir, e as faixas viajam e
+    // são filtradas com 1 canal só (um terço dos dados e do trabalho da mediana)
+    unsigned char *cor = NULL;
+    int canaisCor = canais;
+    if (luma && canais > 1)
+    {
+        if (world_rank == 0)
+        {
+            cor = full_img;
+            full_img = separaCinza(cor, w, h, canaisCor);
+        }
+        canais = 1;
+    }
+
+    unsigned char *rle = NULL;
+    size_t tamanhoRle = 0;
+    uint64_t global_hist[256] = {0};
+    double tempoTrabalho = 0;
+    int linhasProcessadas = 0;
+
+    if (dinamico)
+    {
+        if (world_rank == 0)
+        {
+            // O mestre recebe as faixas prontas num buffer à parte: a entrada ainda fornece o
+            // halo das faixas distribuídas depois
+            unsigned char *saida = (unsigned char *)alocaBuffer((size_t)w * h * canais);
+            mestreDinamico(full_img, saida, w, h, canais, offset, linhasFaixa, world_size, global_hist);
+            liberaBuffer(full_img);
+            full_img = saida;
+
+            unsigned char map[256];
+            mapaEqualizacao(global_hist, (uint64_t)w * h, map);
+            kernels.aplicaLut(full_img, (size_t)w * h, canais, map);
+
+            if (rle8)
+            {
+                rle = (unsigned char *)alocaBuffer(LIMITE_RLE8(w) * h + 2);
+                tamanhoRle = codificaRle8(full_img, w, canais, 0, h, topDown, rle);
+                rle[tamanhoRle++] = 0;
+                rle[tamanhoRle++] = 1; // Fim do bitmap
+            }
+        }
+        else
+            linhasProcessadas = trabalhadorDinamico(w, h, canais, n_filter, linhasFaixa, inPlace, borda, valorBorda,
+                                                    meuFator, &tempoTrabalho);
+    }
+    else
+        divisaoEstatica(MPI_COMM_WORLD, full_img, w, h, canais, topDown, n_filter, inPlace, borda, valorBorda, rle8,
+                        meuFator, global_hist, &rle, &tamanhoRle, &tempoTrabalho, &linhasProcessadas);
+
+    if (world_rank == 0 && cor)
+    {
+        if (!rle8)
+            devolveCinza(cor, full_img, w, h, canaisCor);
+        liberaBuffer(full_img);
+        full_img = cor;
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double end_time = MPI_Wtime();
+
+    // Quanto cada processo trabalhou: mostra o desequilíbrio entre as faixas
+    double *tempos = NULL;
+    int *linhas = NULL;
+    if (world_rank == 0)
+    {
+        tempos = (double *)malloc(world_size * sizeof(double));
+        linhas = (int *)malloc(world_size * sizeof(int));
+    }
+    MPI_Gather(&tempoTrabalho, 1, MPI_DOUBLE, tempos, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Gather(&linhasProcessadas, 1, MPI_INT, linhas, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (world_rank == 0)
+    {
+        printf("Tempo Total: %.6f s\n", end_time - start_time);
+        // Só com --dinamico ou --lento, para a saída da divisão estática não mudar
+        for (int i = 0; i < world_size && (dinamico || rankLento >= 0); i++)
+        {
+            if (dinamico && i == 0)
+                continue;
+            printf("  Processo %d: %d linhas, %.6f s de trabalho%s\n", i, linhas[i], tempos[i],
+                   i == rankLento && fatorLento > 1 ? " (lento)" : "");
+        }
+        free(tempos);
+        free(linhas);
+    }
+    if (toleranciaPlano >= 0)
+        relataPlanos(world_rank, tempoTrabalho);
+
+    if (world_rank == 0)
+    {
+        if (testeW > 0)
+        {
+            int falhas = verificaBlocos(full_img, w, h, canaisCor, n_filter / 2, global_hist);
+            printf("%s\n", falhas ? "FALHOU" : "ok");
+            liberaBuffer(full_img);
+            liberaPool();
+            MPI_Finalize();
+            return falhas ? 2 : 0;
+        }
+        if (rle8)
+        {
+            escreveBitMapRle8(outputFilename, h, rle, tamanhoRle, bmpHead, bmpInfo);
+            liberaBuffer(rle);
+        }
+        else
+            escreveBitMap(outputFilename, w, h, full_img, bmpHead, bmpInfo);
+        printf("Imagem salva em %s\n", outputFilename);
+        liberaBuffer(full_img);
     }
 
-    free(local_output_buf);
+    liberaPool();
     MPI_Finalize();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,415 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Cliente do modo daemon (./main <N> <threads> --daemon <socket>).
+// Envia a imagem por memória compartilhada e mede a latência de ida e volta.
+
+typedef struct
+{
+    uint16_t bfType;
+    uint32_t bfSize; // Tamanho do arquivo
+    uint16_t bfReserved1;
+    uint16_t bfReserved2;
+    uint32_t bfOffBits; // Offset para os dados da imagem
+} BMPHeader;
+
+typedef struct
+{
+    uint32_t biSize;        // Tamanho do cabeçalho info
+    int32_t biWidth;        // Largura
+    int32_t biHeight;       // Altura
+    uint16_t biPlanes;      // Planos
+    uint16_t biBitCount;    // Bits por pixel
+    uint32_t biCompression; // Compressão
+    uint32_t biSizeImage;   // Tamanho da imagem comprimida
+    int32_t biXPelsPerMeter;
+    int32_t biYPelsPerMeter;
+    uint32_t biClrUsed;
+    uint32_t biClrImportant;
+} BMPInfoHeader;
+
+typedef struct
+{
+    int width;
+    int height;
+    int canais;  // Bytes por pixel: 1 (cinza), 3 (BGR) ou 4 (BGRA)
+    int topDown; // Linhas gravadas de cima para baixo (biHeight negativo)
+    unsigned char *data;
+} Image;
+
+Image *leBitMap(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        printf("Erro ao abrir arquivo %s\n", filename);
+        return NULL;
+    }
+
+    BMPHeader bmpHeader;
+    fread(&bmpHeader.bfType, sizeof(uint16_t), 1, f);
+    fread(&bmpHeader.bfSize, sizeof(uint32_t), 1, f);
+    fread(&bmpHeader.bfReserved1, sizeof(uint16_t), 1, f);
+    fread(&bmpHeader.bfReserved2, sizeof(uint16_t), 1, f);
+    fread(&bmpHeader.bfOffBits, sizeof(uint32_t), 1, f);
+
+    BMPInfoHeader bmpInfo;
+    fread(&bmpInfo.biSize, sizeof(uint32_t), 1, f);
+    fread(&bmpInfo.biWidth, sizeof(int32_t), 1, f);
+    fread(&bmpInfo.biHeight, sizeof(int32_t), 1, f);
+    fread(&bmpInfo.biPlanes, sizeof(uint16_t), 1, f);
+    fread(&bmpInfo.biBitCount, sizeof(uint16_t), 1, f);
+    fread(&bmpInfo.biCompression, sizeof(uint32_t), 1, f);
+    fread(&bmpInfo.biSizeImage, sizeof(uint32_t), 1, f);
+    fread(&bmpInfo.biXPelsPerMeter, sizeof(int32_t), 1, f);
+    fread(&bmpInfo.biYPelsPerMeter, sizeof(int32_t), 1, f);
+    fread(&bmpInfo.biClrUsed, sizeof(uint32_t), 1, f);
+    fread(&bmpInfo.biClrImportant, sizeof(uint32_t), 1, f);
+
+    if (bmpHeader.bfType != 0x4D42)
+    {
+        printf("Arquivo não é um BMP válido.\n");
+        fclose(f);
+        return NULL;
+    }
+    if (bmpInfo.biBitCount != 8 && bmpInfo.biBitCount != 24 && bmpInfo.biBitCount != 32)
+    {
+        printf("Este programa suporta apenas BMP de 8, 24 ou 32 bits.\n");
+        fclose(f);
+        return NULL;
+    }
+
+    // 32 bits pode vir como BI_BITFIELDS (3): aceita apenas o layout BGRA
+    if (bmpInfo.biCompression == 3 && bmpInfo.biBitCount == 32)
+    {
+        uint32_t mascaras[3];
+        fseek(f, 14 + 40, SEEK_SET);
+        fread(mascaras, sizeof(uint32_t), 3, f);
+        if (mascaras[0] != 0x00FF0000 || mascaras[1] != 0x0000FF00 || mascaras[2] != 0x000000FF)
+        {
+            printf("Máscaras de cor de 32 bits não suportadas.\n");
+            fclose(f);
+            return NULL;
+        }
+    }
+    else if (bmpInfo.biCompression != 0)
+    {
+        printf("BMP comprimido não suportado.\n");
+        fclose(f);
+        return NULL;
+    }
+
+    // 8 bits: a paleta precisa ser de tons de cinza; guarda o nível de cinza de cada índice
+    unsigned char paleta[256];
+    int paletaIdentidade = 1;
+    for (int i = 0; i < 256; i++)
+        paleta[i] = (unsigned char)i;
+
+    if (bmpInfo.biBitCount == 8)
+    {
+        int nCores = (bmpInfo.biClrUsed > 0 && bmpInfo.biClrUsed <= 256) ? bmpInfo.biClrUsed : 256;
+        fseek(f, 14 + bmpInfo.biSize, SEEK_SET);
+        for (int i = 0; i < nCores; i++)
+        {
+            unsigned char cor[4];
+            fread(cor, 1, 4, f);
+            if (cor[0] != cor[1] || cor[1] != cor[2])
+            {
+                printf("Este programa suporta apenas BMP de 8 bits com paleta em tons de cinza.\n");
+                fclose(f);
+                return NULL;
+            }
+            paleta[i] = cor[0];
+            if (cor[0] != i)
+                paletaIdentidade = 0;
+        }
+    }
+
+    Image *img = (Image *)malloc(sizeof(Image));
+    img->width = bmpInfo.biWidth;
+    img->height = abs(bmpInfo.biHeight);
+    img->canais = bmpInfo.biBitCount / 8;
+    img->topDown = bmpInfo.biHeight < 0;
+
+    int rowSize = img->width * img->canais;
+    img->data = (unsigned char *)malloc((size_t)rowSize * img->height);
+    if (!img->data)
+    {
+        printf("Memória insuficiente para %dx%d.\n", img->width, img->height);
+        free(img);
+        fclose(f);
+        return NULL;
+    }
+
+    int padding = (4 - rowSize % 4) % 4;
+
+    fseek(f, bmpHeader.bfOffBits, SEEK_SET);
+
+    // Ler pixels no layout do próprio arquivo, linha a linha
+    for (int y = 0; y < img->height; y++)
+    {
+        unsigned char *linha = &img->data[(size_t)y * rowSize];
+        fread(linha, rowSize, 1, f);
+        if (!paletaIdentidade)
+        {
+            for (int x = 0; x < rowSize; x++)
+                linha[x] = paleta[linha[x]];
+        }
+        fseek(f, padding, SEEK_CUR);
+    }
+
+    fclose(f);
+    return img;
+}
+
+void escreveBitMap(const char *filename, Image *img)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        printf("Erro ao criar arquivo %s\n", filename);
+        return;
+    }
+
+    int rowSize = img->width * img->canais;
+    int padding = (4 - rowSize % 4) % 4;
+    uint64_t dataSize = (uint64_t)(rowSize + padding) * img->height;
+    int paletaSize = img->canais == 1 ? 256 * 4 : 0;
+    // Como no main.c: acima de 4 GB os campos de tamanho não cabem em 32 bits e vão como 0
+    uint64_t fileSize = 14 + 40 + paletaSize + dataSize;
+    int cabe32 = fileSize <= UINT32_MAX;
+
+    BMPHeader bmpHeader;
+    bmpHeader.bfType = 0x4D42;
+    bmpHeader.bfSize = cabe32 ? (uint32_t)fileSize : 0;
+    bmpHeader.bfReserved1 = 0;
+    bmpHeader.bfReserved2 = 0;
+    bmpHeader.bfOffBits = 14 + 40 + paletaSize;
+
+    BMPInfoHeader bmpInfo;
+    bmpInfo.biSize = 40;
+    bmpInfo.biWidth = img->width;
+    bmpInfo.biHeight = img->topDown ? -img->height : img->height;
+    bmpInfo.biPlanes = 1;
+    bmpInfo.biBitCount = img->canais * 8;
+    bmpInfo.biCompression = 0;
+    bmpInfo.biSizeImage = cabe32 ? (uint32_t)dataSize : 0;
+    bmpInfo.biXPelsPerMeter = 0;
+    bmpInfo.biYPelsPerMeter = 0;
+    bmpInfo.biClrUsed = img->canais == 1 ? 256 : 0;
+    bmpInfo.biClrImportant = 0;
+
+    fwrite(&bmpHeader.bfType, sizeof(uint16_t), 1, f);
+    fwrite(&bmpHeader.bfSize, sizeof(uint32_t), 1, f);
+    fwrite(&bmpHeader.bfReserved1, sizeof(uint16_t), 1, f);
+    fwrite(&bmpHeader.bfReserved2, sizeof(uint16_t), 1, f);
+    fwrite(&bmpHeader.bfOffBits, sizeof(uint32_t), 1, f);
+
+    fwrite(&bmpInfo.biSize, sizeof(uint32_t), 1, f);
+    fwrite(&bmpInfo.biWidth, sizeof(int32_t), 1, f);
+    fwrite(&bmpInfo.biHeight, sizeof(int32_t), 1, f);
+    fwrite(&bmpInfo.biPlanes, sizeof(uint16_t), 1, f);
+    fwrite(&bmpInfo.biBitCount, sizeof(uint16_t), 1, f);
+    fwrite(&bmpInfo.biCompression, sizeof(uint32_t), 1, f);
+    fwrite(&bmpInfo.biSizeImage, sizeof(uint32_t), 1, f);
+    fwrite(&bmpInfo.biXPelsPerMeter, sizeof(int32_t), 1, f);
+    fwrite(&bmpInfo.biYPelsPerMeter, sizeof(int32_t), 1, f);
+    fwrite(&bmpInfo.biClrUsed, sizeof(uint32_t), 1, f);
+    fwrite(&bmpInfo.biClrImportant, sizeof(uint32_t), 1, f);
+
+    // Paleta de tons de cinza para 8 bits
+    for (int i = 0; i < paletaSize / 4; i++)
+    {
+        unsigned char cor[4] = {(unsigned char)i, (unsigned char)i, (unsigned char)i, 0};
+        fwrite(cor, 1, 4, f);
+    }
+
+    for (int y = 0; y < img->height; y++)
+    {
+        fwrite(&img->data[(size_t)y * rowSize], rowSize, 1, f);
+        unsigned char pad[3] = {0, 0, 0};
+        fwrite(pad, 1, padding, f);
+    }
+
+    fclose(f);
+}
+
+// Protocolo do modo daemon (mantenha igual em main.c).
+// O cliente envia um PedidoDaemon junto com um descritor (memfd/shm) via SCM_RIGHTS.
+// O descritor contém 2 * width * height * canais bytes: a entrada seguida da área de saída.
+typedef struct
+{
+    int32_t width;
+    int32_t height;
+    int32_t canais; // 1 (cinza), 3 (BGR) ou 4 (BGRA)
+    int32_t n_filter;
+    int32_t borda;
+    int32_t valorBorda;
+} PedidoDaemon;
+
+typedef struct
+{
+    int32_t status; // 0 = ok
+    double tempo;   // Tempo de processamento no daemon (s)
+} RespostaDaemon;
+
+// Cria um descritor anônimo em memória com o tamanho pedido
+int criaMemoriaCompartilhada(size_t tamanho)
+{
+#ifdef __linux__
+    int fd = memfd_create("equalizacao", 0);
+#else
+    char nome[64];
+    snprintf(nome, sizeof(nome), "/equalizacao-%d", (int)getpid());
+    int fd = shm_open(nome, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+        shm_unlink(nome);
+#endif
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, tamanho) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int enviaPedido(int sock, const PedidoDaemon *pedido, int fd)
+{
+    struct iovec iov = {(void *)pedido, sizeof(PedidoDaemon)};
+    char controle[CMSG_SPACE(sizeof(int))];
+    memset(controle, 0, sizeof(controle));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = controle;
+    msg.msg_controllen = sizeof(controle);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == sizeof(PedidoDaemon);
+}
+
+double agora()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int comparaDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        printf("Uso: %s <socket> <entrada.bmp> <saida.bmp> [tamanho_filtro_N] [repeticoes]\n", argv[0]);
+        return 1;
+    }
+
+    const char *caminho = argv[1];
+    int n_filter = argc > 4 ? atoi(argv[4]) : 0;
+    int repeticoes = argc > 5 ? atoi(argv[5]) : 1;
+    if (repeticoes < 1)
+        repeticoes = 1;
+
+    Image *img = leBitMap(argv[2]);
+    if (!img)
+        return 1;
+
+    size_t bytes = (size_t)img->width * img->height * img->canais;
+    int fd = criaMemoriaCompartilhada(2 * bytes);
+    if (fd < 0)
+    {
+        perror("memoria compartilhada");
+        return 1;
+    }
+
+    unsigned char *mem = (unsigned char *)mmap(NULL, 2 * bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    // Um produtor real escreveria direto em mem; aqui a cópia fica fora da medição
+    memcpy(mem, img->data, bytes);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un endereco;
+    memset(&endereco, 0, sizeof(endereco));
+    endereco.sun_family = AF_UNIX;
+    strncpy(endereco.sun_path, caminho, sizeof(endereco.sun_path) - 1);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&endereco, sizeof(endereco)) != 0)
+    {
+        perror("connect");
+        return 1;
+    }
+
+    PedidoDaemon pedido = {img->width, img->height, img->canais, n_filter, 0, 0};
+    double *latencias = (double *)malloc(repeticoes * sizeof(double));
+    double tempoDaemon = 0.0;
+
+    for (int i = 0; i < repeticoes; i++)
+    {
+        RespostaDaemon resposta;
+        double inicio = agora();
+        if (!enviaPedido(sock, &pedido, fd) ||
+            recv(sock, &resposta, sizeof(resposta), MSG_WAITALL) != sizeof(resposta))
+        {
+            printf("Erro na comunicacao com o daemon.\n");
+            return 1;
+        }
+        latencias[i] = agora() - inicio;
+
+        if (resposta.status != 0)
+        {
+            printf("Daemon recusou o pedido (status %d).\n", resposta.status);
+            return 1;
+        }
+        tempoDaemon += resposta.tempo;
+    }
+
+    qsort(latencias, repeticoes, sizeof(double), comparaDouble);
+    double soma = 0.0;
+    for (int i = 0; i < repeticoes; i++)
+        soma += latencias[i];
+
+    printf("Pedidos: %d  Imagem: %dx%d\n", repeticoes, img->width, img->height);
+    printf("Latencia (ms): min %.3f  media %.3f  p95 %.3f  max %.3f\n",
+           latencias[0] * 1e3, soma / repeticoes * 1e3,
+           latencias[(int)(0.95 * (repeticoes - 1))] * 1e3, latencias[repeticoes - 1] * 1e3);
+    printf("Processamento no daemon (ms, media): %.3f\n", tempoDaemon / repeticoes * 1e3);
+
+    memcpy(img->data, mem + bytes, bytes);
+    escreveBitMap(argv[3], img);
+    printf("Imagem salva em '%s'.\n", argv[3]);
+
+    free(latencias);
+    munmap(mem, 2 * bytes);
+    close(fd);
+    close(sock);
+    free(img->data);
+    free(img);
+    return 0;
+}
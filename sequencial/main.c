@@ -3,6 +3,15 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #define N_FILTER 3
 
@@ -34,10 +43,101 @@ typedef struct
 {
     int width;
     int height;
+    int canais;  // Bytes por pixel: 1 (cinza), 3 (BGR) ou 4 (BGRA)
+    int topDown; // Linhas gravadas de cima para baixo (biHeight negativo)
     unsigned char *data;
 } Image;
 
-Image *leBitMap(const char *filename)
+// Pool de buffers de pixels e de rascunho. Todo buffer sai alinhado a 64 bytes (linha de
+// cache e largura do AVX-512); a partir de 2 MB sai alinhado à huge page e com
+// MADV_HUGEPAGE, para o kernel usar huge pages transparentes e cortar as faltas de TLB.
+// liberaBuffer devolve o buffer ao pool, e o próximo pedido de tamanho parecido o
+// reaproveita sem passar pelo malloc nem pelas faltas de página do primeiro acesso.
+#define ALINHAMENTO_BUFFER 64
+#define TAMANHO_HUGE_PAGE (2 * 1024 * 1024)
+#define MAX_BUFFERS_POOL 32
+
+typedef struct
+{
+    void *ptr;
+    size_t tamanho;
+    int livre;
+} BufferPool;
+
+BufferPool pool[MAX_BUFFERS_POOL];
+int nPool = 0;
+int poolAtivo = 1; // --sem-pool usa malloc/free direto, para comparação
+
+void *alocaBuffer(size_t n)
+{
+    if (n == 0)
+        n = 1;
+    if (!poolAtivo)
+        return malloc(n);
+
+    // Menor buffer livre em que n caiba sem desperdiçar mais da metade
+    int melhor = -1;
+    for (int i = 0; i < nPool; i++)
+    {
+        if (pool[i].livre && pool[i].tamanho >= n && pool[i].tamanho / 2 <= n &&
+            (melhor < 0 || pool[i].tamanho < pool[melhor].tamanho))
+            melhor = i;
+    }
+    if (melhor >= 0)
+    {
+        pool[melhor].livre = 0;
+        return pool[melhor].ptr;
+    }
+
+    size_t alinhamento = n >= TAMANHO_HUGE_PAGE ? TAMANHO_HUGE_PAGE : ALINHAMENTO_BUFFER;
+    size_t tamanho = (n + alinhamento - 1) / alinhamento * alinhamento;
+    void *p;
+    if (posix_memalign(&p, alinhamento, tamanho) != 0)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (alinhamento == TAMANHO_HUGE_PAGE)
+        madvise(p, tamanho, MADV_HUGEPAGE);
+#endif
+
+    // Com o pool cheio o buffer não é registrado e liberaBuffer o devolve ao sistema
+    if (nPool < MAX_BUFFERS_POOL)
+    {
+        pool[nPool].ptr = p;
+        pool[nPool].tamanho = tamanho;
+        pool[nPool].livre = 0;
+        nPool++;
+    }
+    return p;
+}
+
+void liberaBuffer(void *p)
+{
+    if (!p)
+        return;
+    for (int i = 0; i < nPool; i++)
+    {
+        if (pool[i].ptr == p)
+        {
+            pool[i].livre = 1;
+            return;
+        }
+    }
+    free(p);
+}
+
+void liberaPool()
+{
+    for (int i = 0; i < nPool; i++)
+        free(pool[i].ptr);
+    nPool = 0;
+}
+
+// Lê só o retângulo [rx, rx + rw) x [ry, ry + rh) (y a partir do topo), ampliado por halo
+// pixels de cada lado e cortado nas bordas da imagem: cada linha é lida com um fseek direto
+// para as suas colunas. Sem temRegiao lê a imagem inteira. *dx e *dy recebem a posição do
+// retângulo pedido dentro da imagem lida, cujas linhas ficam na ordem do arquivo. passo > 1
+// lê só uma linha a cada passo (amostragem).
+Image *leBitMapRegiao(const char *filename, int temRegiao, int rx, int ry, int rw, int rh, int halo, int passo, int *dx, int *dy)
 {
     FILE *f = fopen(filename, "rb");
     if (!f)
@@ -72,69 +172,162 @@ Image *leBitMap(const char *filename)
         fclose(f);
         return NULL;
     }
-    if (bmpInfo.biBitCount != 24)
+    if (bmpInfo.biBitCount != 8 && bmpInfo.biBitCount != 24 && bmpInfo.biBitCount != 32)
     {
-        printf("Este programa suporta apenas BMP 24 bits.\n");
+        printf("Este programa suporta apenas BMP de 8, 24 ou 32 bits.\n");
         fclose(f);
         return NULL;
     }
 
-    Image *img = (Image *)malloc(sizeof(Image));
-    img->width = bmpInfo.biWidth;
-    img->height = abs(bmpInfo.biHeight);
+    // 32 bits pode vir como BI_BITFIELDS (3): aceita apenas o layout BGRA
+    if (bmpInfo.biCompression == 3 && bmpInfo.biBitCount == 32)
+    {
+        uint32_t mascaras[3];
+        fseek(f, 14 + 40, SEEK_SET);
+        fread(mascaras, sizeof(uint32_t), 3, f);
+        if (mascaras[0] != 0x00FF0000 || mascaras[1] != 0x0000FF00 || mascaras[2] != 0x000000FF)
+        {
+            printf("Máscaras de cor de 32 bits não suportadas.\n");
+            fclose(f);
+            return NULL;
+        }
+    }
+    else if (bmpInfo.biCompression != 0)
+    {
+        printf("BMP comprimido não suportado.\n");
+        fclose(f);
+        return NULL;
+    }
+
+    // 8 bits: a paleta precisa ser de tons de cinza; guarda o nível de cinza de cada índice
+    unsigned char paleta[256];
+    int paletaIdentidade = 1;
+    for (int i = 0; i < 256; i++)
+        paleta[i] = (unsigned char)i;
+
+    if (bmpInfo.biBitCount == 8)
+    {
+        int nCores = (bmpInfo.biClrUsed > 0 && bmpInfo.biClrUsed <= 256) ? bmpInfo.biClrUsed : 256;
+        fseek(f, 14 + bmpInfo.biSize, SEEK_SET);
+        for (int i = 0; i < nCores; i++)
+        {
+            unsigned char cor[4];
+            fread(cor, 1, 4, f);
+            if (cor[0] != cor[1] || cor[1] != cor[2])
+            {
+                printf("Este programa suporta apenas BMP de 8 bits com paleta em tons de cinza.\n");
+                fclose(f);
+                return NULL;
+            }
+            paleta[i] = cor[0];
+            if (cor[0] != i)
+                paletaIdentidade = 0;
+        }
+    }
 
-    img->data = (unsigned char *)malloc(img->width * img->height * 3);
+    int width = bmpInfo.biWidth;
+    int height = abs(bmpInfo.biHeight);
+    int canais = bmpInfo.biBitCount / 8;
+    int topDown = bmpInfo.biHeight < 0;
 
-    int padding = (4 - (img->width * 3) % 4) % 4;
+    if (!temRegiao)
+    {
+        rx = 0;
+        ry = 0;
+        rw = width;
+        rh = height;
+    }
+    if (rx < 0 || ry < 0 || rw <= 0 || rh <= 0 || rx + rw > width || ry + rh > height)
+    {
+        printf("Regiao fora da imagem (%dx%d).\n", width, height);
+        fclose(f);
+        return NULL;
+    }
+    int x0 = rx - halo < 0 ? 0 : rx - halo;
+    int x1 = rx + rw + halo > width ? width : rx + rw + halo;
+    int y0 = ry - halo < 0 ? 0 : ry - halo;
+    int y1 = ry + rh + halo > height ? height : ry + rh + halo;
+    *dx = rx - x0;
+    *dy = topDown ? ry - y0 : y1 - (ry + rh);
+
+    Image *img = (Image *)malloc(sizeof(Image));
+    img->width = x1 - x0;
+    img->height = (y1 - y0 + passo - 1) / passo;
+    img->canais = canais;
+    img->topDown = topDown;
 
-    fseek(f, bmpHeader.bfOffBits, SEEK_SET);
+    int rowSize = img->width * canais;
+    img->data = (unsigned char *)alocaBuffer((size_t)rowSize * img->height);
 
-    // Ler pixels
+    int rowSizeArquivo = width * canais;
+    int padding = (4 - rowSizeArquivo % 4) % 4;
+
+    // Ler pixels no layout do próprio arquivo, linha a linha
     for (int y = 0; y < img->height; y++)
     {
-        for (int x = 0; x < img->width; x++)
+        int linhaArquivo = (topDown ? y0 : height - y1) + y * passo;
+        fseek(f, bmpHeader.bfOffBits + (long)linhaArquivo * (rowSizeArquivo + padding) + (long)x0 * canais, SEEK_SET);
+
+        unsigned char *linha = &img->data[(size_t)y * rowSize];
+        fread(linha, rowSize, 1, f);
+        if (!paletaIdentidade)
         {
-            // Ler B, G, R
-            int index = (y * img->width + x) * 3;
-            fread(&img->data[index], 3, 1, f);
+            for (int x = 0; x < rowSize; x++)
+                linha[x] = paleta[linha[x]];
         }
-        fseek(f, padding, SEEK_CUR);
     }
 
     fclose(f);
     return img;
 }
 
-void escreveBitMap(const char *filename, Image *img)
+Image *leBitMap(const char *filename)
 {
-    FILE *f = fopen(filename, "wb");
-    if (!f)
-    {
-        printf("Erro ao criar arquivo %s\n", filename);
-        return;
-    }
+    int dx, dy;
+    return leBitMapRegiao(filename, 0, 0, 0, 0, 0, 0, 1, &dx, &dy);
+}
+
+// Novo buffer só com o retângulo (x, y, w, h), em linhas de memória
+void recortaImagem(Image *img, int x, int y, int w, int h)
+{
+    int canais = img->canais;
+    unsigned char *recorte = (unsigned char *)alocaBuffer((size_t)w * h * canais);
+    for (int i = 0; i < h; i++)
+        memcpy(recorte + (size_t)i * w * canais, img->data + ((size_t)(y + i) * img->width + x) * canais, (size_t)w * canais);
+
+    liberaBuffer(img->data);
+    img->data = recorte;
+    img->width = w;
+    img->height = h;
+}
 
-    int padding = (4 - (img->width * 3) % 4) % 4;
-    int dataSize = (img->width * 3 + padding) * img->height;
+// Grava os cabeçalhos e, em 8 bits, a paleta de tons de cinza. altura negativa é top-down.
+// Acima de 4 GB os campos de tamanho não cabem em 32 bits e são gravados como 0; a leitura
+// usa só largura, altura e bfOffBits.
+void escreveCabecalhos(FILE *f, int w, int altura, int canais, uint32_t compressao, uint64_t dataSize)
+{
+    int paletaSize = canais == 1 ? 256 * 4 : 0;
+    uint64_t fileSize = 14 + 40 + paletaSize + dataSize;
+    int cabe32 = fileSize <= UINT32_MAX;
 
     BMPHeader bmpHeader;
     bmpHeader.bfType = 0x4D42;
-    bmpHeader.bfSize = 14 + 40 + dataSize;
+    bmpHeader.bfSize = cabe32 ? (uint32_t)fileSize : 0;
     bmpHeader.bfReserved1 = 0;
     bmpHeader.bfReserved2 = 0;
-    bmpHeader.bfOffBits = 14 + 40;
+    bmpHeader.bfOffBits = 14 + 40 + paletaSize;
 
     BMPInfoHeader bmpInfo;
     bmpInfo.biSize = 40;
-    bmpInfo.biWidth = img->width;
-    bmpInfo.biHeight = img->height;
+    bmpInfo.biWidth = w;
+    bmpInfo.biHeight = altura;
     bmpInfo.biPlanes = 1;
-    bmpInfo.biBitCount = 24;
-    bmpInfo.biCompression = 0;
-    bmpInfo.biSizeImage = dataSize;
+    bmpInfo.biBitCount = canais * 8;
+    bmpInfo.biCompression = compressao;
+    bmpInfo.biSizeImage = cabe32 ? (uint32_t)dataSize : 0;
     bmpInfo.biXPelsPerMeter = 0;
     bmpInfo.biYPelsPerMeter = 0;
-    bmpInfo.biClrUsed = 0;
+    bmpInfo.biClrUsed = canais == 1 ? 256 : 0;
     bmpInfo.biClrImportant = 0;
 
     fwrite(&bmpHeader.bfType, sizeof(uint16_t), 1, f);
@@ -155,13 +348,32 @@ void escreveBitMap(const char *filename, Image *img)
     fwrite(&bmpInfo.biClrUsed, sizeof(uint32_t), 1, f);
     fwrite(&bmpInfo.biClrImportant, sizeof(uint32_t), 1, f);
 
+    // Paleta de tons de cinza para 8 bits
+    for (int i = 0; i < paletaSize / 4; i++)
+    {
+        unsigned char cor[4] = {(unsigned char)i, (unsigned char)i, (unsigned char)i, 0};
+        fwrite(cor, 1, 4, f);
+    }
+}
+
+void escreveBitMap(const char *filename, Image *img)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        printf("Erro ao criar arquivo %s\n", filename);
+        return;
+    }
+
+    int rowSize = img->width * img->canais;
+    int padding = (4 - rowSize % 4) % 4;
+    uint64_t dataSize = (uint64_t)(rowSize + padding) * img->height;
+
+    escreveCabecalhos(f, img->width, img->topDown ? -img->height : img->height, img->canais, 0, dataSize);
+
     for (int y = 0; y < img->height; y++)
     {
-        for (int x = 0; x < img->width; x++)
-        {
-            int index = (y * img->width + x) * 3;
-            fwrite(&img->data[index], 3, 1, f);
-        }
+        fwrite(&img->data[(size_t)y * rowSize], rowSize, 1, f);
         unsigned char pad[3] = {0, 0, 0};
         fwrite(pad, 1, padding, f);
     }
@@ -169,167 +381,2731 @@ void escreveBitMap(const char *filename, Image *img)
     fclose(f);
 }
 
-int compare(const void *a, const void *b)
+// Maior RLE8 possível para uma linha: cada pixel num par (1, valor), mais o fim de linha
+#define LIMITE_RLE8(w) (2 * (size_t)(w) + 2)
+
+// Quantos pixels iguais ao de x seguem a partir de x, até max
+static inline int comprimentoRun(const unsigned char *linha, int x, int w, int canais, int max)
 {
-    return (*(unsigned char *)a - *(unsigned char *)b);
+    int n = 1;
+    while (x + n < w && n < max && linha[(x + n) * canais] == linha[x * canais])
+        n++;
+    return n;
 }
 
-void filtroMediana(Image *img)
+// Codifica as linhas [y0, y1) em RLE8, cada uma terminada por fim de linha (0, 0); o byte 0
+// de cada pixel é o cinza. invertido percorre de y1 - 1 até y0. Retorna os bytes gravados.
+size_t codificaRle8(const unsigned char *data, int w, int canais, int y0, int y1, int invertido, unsigned char *saida)
 {
-    int w = img->width;
-    int h = img->height;
-    unsigned char *newData = (unsigned char *)malloc(w * h * 3);
-
-    int offset = N_FILTER / 2;
-    int windowSize = N_FILTER * N_FILTER;
-
-    unsigned char *windowR = (unsigned char *)malloc(windowSize);
-    unsigned char *windowG = (unsigned char *)malloc(windowSize);
-    unsigned char *windowB = (unsigned char *)malloc(windowSize);
-
-    for (int y = 0; y < h; y++)
+    unsigned char *p = saida;
+    for (int i = y0; i < y1; i++)
     {
-        for (int x = 0; x < w; x++)
+        int y = invertido ? y0 + y1 - 1 - i : i;
+        const unsigned char *linha = data + (size_t)y * w * canais;
+        int x = 0;
+        while (x < w)
         {
-            int currentIdx = (y * w + x) * 3;
-
-            // Se estiver na borda, mantém o valor original
-            if (y < offset || y >= h - offset || x < offset || x >= w - offset)
+            int run = comprimentoRun(linha, x, w, canais, 255);
+            if (run >= 3)
             {
-                newData[currentIdx] = img->data[currentIdx];
-                newData[currentIdx + 1] = img->data[currentIdx + 1];
-                newData[currentIdx + 2] = img->data[currentIdx + 2];
+                *p++ = (unsigned char)run;
+                *p++ = linha[x * canais];
+                x += run;
                 continue;
             }
 
-            int count = 0;
-            for (int ky = -offset; ky <= offset; ky++)
+            // Modo absoluto até o próximo run de 3 ou mais; ele exige pelo menos 3 pixels
+            int fim = x + 1;
+            while (fim < w && fim - x < 255 &&
+                   !(fim + 2 < w && linha[fim * canais] == linha[(fim + 1) * canais] && linha[fim * canais] == linha[(fim + 2) * canais]))
+                fim++;
+            int n = fim - x;
+            if (n >= 3)
             {
-                for (int kx = -offset; kx <= offset; kx++)
+                *p++ = 0;
+                *p++ = (unsigned char)n;
+                for (; x < fim; x++)
+                    *p++ = linha[x * canais];
+                if (n & 1)
+                    *p++ = 0; // Cada bloco absoluto termina alinhado em 16 bits
+            }
+            else
+            {
+                while (x < fim)
                 {
-                    int neighborIdx = ((y + ky) * w + (x + kx)) * 3;
-                    windowB[count] = img->data[neighborIdx];
-                    windowG[count] = img->data[neighborIdx + 1];
-                    windowR[count] = img->data[neighborIdx + 2];
-                    count++;
+                    int r = comprimentoRun(linha, x, fim, canais, 2);
+                    *p++ = (unsigned char)r;
+                    *p++ = linha[x * canais];
+                    x += r;
                 }
             }
-
-            qsort(windowB, windowSize, sizeof(unsigned char), compare);
-            qsort(windowG, windowSize, sizeof(unsigned char), compare);
-            qsort(windowR, windowSize, sizeof(unsigned char), compare);
-
-            newData[currentIdx] = windowB[windowSize / 2];
-            newData[currentIdx + 1] = windowG[windowSize / 2];
-            newData[currentIdx + 2] = windowR[windowSize / 2];
         }
+        *p++ = 0;
+        *p++ = 0;
+    }
+    return p - saida;
+}
+
+// Grava a saída em tons de cinza como BMP de 8 bits comprimido (BI_RLE8). Só o cinza é
+// gravado (R = G = B depois do grayscale; o alfa se perde). RLE8 é sempre de baixo para
+// cima, então uma imagem top-down é codificada da última linha para a primeira.
+void escreveBitMapRle8(const char *filename, Image *img)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        printf("Erro ao criar arquivo %s\n", filename);
+        return;
     }
 
-    free(windowR);
-    free(windowG);
-    free(windowB);
+    unsigned char *rle = (unsigned char *)alocaBuffer(LIMITE_RLE8(img->width) * img->height + 2);
+    size_t n = codificaRle8(img->data, img->width, img->canais, 0, img->height, img->topDown, rle);
+    rle[n++] = 0;
+    rle[n++] = 1; // Fim do bitmap
+
+    escreveCabecalhos(f, img->width, img->height, 1, 1, n);
+    fwrite(rle, 1, n, f);
 
-    free(img->data);
-    img->data = newData;
+    liberaBuffer(rle);
+    fclose(f);
 }
 
-void grayscale(Image *img)
+int compare(const void *a, const void *b)
 {
-    int w = img->width;
-    int h = img->height;
+    return (*(unsigned char *)a - *(unsigned char *)b);
+}
+
+typedef enum
+{
+    BORDA_COPIAR,    // Mantém os pixels da borda sem filtrar
+    BORDA_REPLICAR,  // Repete o pixel mais próximo da borda
+    BORDA_REFLETIR,  // Espelha a imagem a partir da borda
+    BORDA_CONSTANTE  // Completa a janela com um valor fixo
+} ModoBorda;
+
+int leModoBorda(const char *nome, ModoBorda *modo)
+{
+    if (strcmp(nome, "copiar") == 0)
+        *modo = BORDA_COPIAR;
+    else if (strcmp(nome, "replicar") == 0)
+        *modo = BORDA_REPLICAR;
+    else if (strcmp(nome, "refletir") == 0)
+        *modo = BORDA_REFLETIR;
+    else if (strcmp(nome, "constante") == 0)
+        *modo = BORDA_CONSTANTE;
+    else
+        return 0;
+    return 1;
+}
 
-    for (int i = 0; i < w * h; i++)
+// Converte uma coordenada fora da imagem para uma coordenada válida conforme o modo.
+// Retorna -1 quando o vizinho deve assumir o valor constante.
+int indiceBorda(int i, int n, ModoBorda modo)
+{
+    if (i >= 0 && i < n)
+        return i;
+    if (modo == BORDA_CONSTANTE)
+        return -1;
+    if (modo == BORDA_REFLETIR)
+        i = (i < 0) ? -i - 1 : 2 * n - i - 1;
+    if (i < 0)
+        i = 0;
+    if (i >= n)
+        i = n - 1;
+    return i;
+}
+
+unsigned char mediana(unsigned char *window, int windowSize)
+{
+    qsort(window, windowSize, sizeof(unsigned char), compare);
+    return window[windowSize / 2];
+}
+
+// As linhas de src começam na linha global srcY0; dst aponta para a linha de saída y
+
+// Pixels cuja janela cabe inteira na imagem: nenhum teste de borda no laço.
+// Cinza (1 canal) tem um laço próprio; em BGRA o alfa é copiado do pixel central.
+void medianaInterior(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int offset, int canais,
+                     unsigned char *winB, unsigned char *winG, unsigned char *winR)
+{
+    int window_size = (2 * offset + 1) * (2 * offset + 1);
+
+    if (canais == 1)
     {
-        int idx = i * 3;
-        unsigned char b = img->data[idx];
-        unsigned char g = img->data[idx + 1];
-        unsigned char r = img->data[idx + 2];
+        for (int x = x0; x < x1; x++)
+        {
+            int count = 0;
+            for (int ky = -offset; ky <= offset; ky++)
+            {
+                const unsigned char *linha = src + (size_t)(y - srcY0 + ky) * w + (x - offset);
+                for (int kx = 0; kx <= 2 * offset; kx++)
+                    winB[count++] = linha[kx];
+            }
+            dst[x] = mediana(winB, window_size);
+        }
+        return;
+    }
 
-        unsigned char gray = (unsigned char)(0.299 * r + 0.587 * g + 0.114 * b);
+    for (int x = x0; x < x1; x++)
+    {
+        int count = 0;
+        for (int ky = -offset; ky <= offset; ky++)
+        {
+            const unsigned char *linha = src + ((size_t)(y - srcY0 + ky) * w + (x - offset)) * canais;
+            for (int kx = 0; kx <= 2 * offset; kx++)
+            {
+                winB[count] = linha[kx * canais];
+                winG[count] = linha[kx * canais + 1];
+                winR[count] = linha[kx * canais + 2];
+                count++;
+            }
+        }
 
-        img->data[idx] = gray;
-        img->data[idx + 1] = gray;
-        img->data[idx + 2] = gray;
+        dst[x * canais] = mediana(winB, window_size);
+        dst[x * canais + 1] = mediana(winG, window_size);
+        dst[x * canais + 2] = mediana(winR, window_size);
+        if (canais == 4)
+            dst[x * canais + 3] = src[((size_t)(y - srcY0) * w + x) * canais + 3];
     }
 }
 
-void equalizacao(Image *img)
+// Maior N aceito: a janela (N * N bytes por canal) e os kernels SIMD, que contam os vizinhos
+// até N = 255, ficam limitados. Vale para a linha de comando e para o daemon.
+#define FILTRO_MAXIMO 255
+
+// Kernels especializados para N = 3, 5, 7 e 9. A janela é vista como N colunas
+// ordenadas: ao deslizar um pixel, só a coluna que entra é ordenada, e a mediana
+// sai de uma intercalação parcial das colunas em vez de um qsort completo.
+#define N_ESPECIALIZADO_MAX 9
+
+static inline void carregaColuna(unsigned char *coluna, const unsigned char *src, int w, int yLocal, int x, int canais, int c, const int n)
 {
-    int w = img->width;
-    int h = img->height;
-    int totalPixels = w * h;
+    int offset = n / 2;
+    for (int k = 0; k < n; k++)
+    {
+        unsigned char v = src[((size_t)(yLocal - offset + k) * w + x) * canais + c];
+        int j = k;
+        while (j > 0 && coluna[j - 1] > v)
+        {
+            coluna[j] = coluna[j - 1];
+            j--;
+        }
+        coluna[j] = v;
+    }
+}
 
-    int histogram[256] = {0};
-    for (int i = 0; i < totalPixels; i++)
+static inline unsigned char intercalaMediana(unsigned char colunas[][N_ESPECIALIZADO_MAX], const int n)
+{
+    int topo[N_ESPECIALIZADO_MAX] = {0};
+    unsigned char valor = 0;
+
+    for (int k = 0; k <= n * n / 2; k++)
     {
-        unsigned char val = img->data[i * 3];
-        histogram[val]++;
+        int menor = -1;
+        for (int j = 0; j < n; j++)
+        {
+            if (topo[j] < n && (menor < 0 || colunas[j][topo[j]] < colunas[menor][topo[menor]]))
+                menor = j;
+        }
+        valor = colunas[menor][topo[menor]++];
     }
+    return valor;
+}
 
-    int cdf[256] = {0};
-    cdf[0] = histogram[0];
-    for (int i = 1; i < 256; i++)
+static inline void medianaColunas(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais, const int n)
+{
+    int yLocal = y - srcY0;
+    int offset = n / 2;
+    int nCor = canais == 1 ? 1 : 3;
+    // [canal][coluna x % n][linha ordenada]
+    unsigned char colunas[3][N_ESPECIALIZADO_MAX][N_ESPECIALIZADO_MAX];
+
+    for (int c = 0; c < nCor; c++)
     {
-        cdf[i] = cdf[i - 1] + histogram[i];
+        for (int x = x0 - offset; x < x0 + offset; x++)
+            carregaColuna(colunas[c][x % n], src, w, yLocal, x, canais, c, n);
     }
 
-    int cdfMin = 0;
-    for (int i = 0; i < 256; i++)
+    for (int x = x0; x < x1; x++)
     {
-        if (cdf[i] > 0)
+        for (int c = 0; c < nCor; c++)
         {
-            cdfMin = cdf[i];
-            break;
+            carregaColuna(colunas[c][(x + offset) % n], src, w, yLocal, x + offset, canais, c, n);
+            dst[x * canais + c] = intercalaMediana(colunas[c], n);
         }
+        if (canais == 4)
+            dst[x * canais + 3] = src[((size_t)yLocal * w + x) * canais + 3];
     }
+}
 
-    unsigned char map[256];
-    for (int i = 0; i < 256; i++)
+void medianaInterior3(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais)
+{
+    medianaColunas(src, srcY0, dst, w, y, x0, x1, canais, 3);
+}
+
+void medianaInterior5(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais)
+{
+    medianaColunas(src, srcY0, dst, w, y, x0, x1, canais, 5);
+}
+
+void medianaInterior7(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais)
+{
+    medianaColunas(src, srcY0, dst, w, y, x0, x1, canais, 7);
+}
+
+void medianaInterior9(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais)
+{
+    medianaColunas(src, srcY0, dst, w, y, x0, x1, canais, 9);
+}
+
+typedef void (*KernelMediana)(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais);
+
+// Indexada pelo offset (N / 2); tamanhos sem kernel próprio usam o caminho genérico
+KernelMediana tabelaMediana[N_ESPECIALIZADO_MAX / 2 + 1] = {
+    NULL, medianaInterior3, medianaInterior5, medianaInterior7, medianaInterior9};
+
+KernelMediana kernelMediana(int offset)
+{
+    if (offset < 0 || offset > N_ESPECIALIZADO_MAX / 2)
+        return NULL;
+    return tabelaMediana[offset];
+}
+
+// Registro de kernels por conjunto de instruções. O mesmo corpo é compilado uma vez
+// por ISA (atributo target) e a variante é escolhida na inicialização via cpuid.
+#if defined(__x86_64__) || defined(__i386__)
+#define ISA_X86 1
+#endif
+
+#define SEMPRE_INLINE static inline __attribute__((always_inline))
+#define BLOCO_MEDIANA 64
+
+typedef enum
+{
+    ISA_ESCALAR,
+    ISA_SSE41,
+    ISA_AVX2,
+    ISA_AVX512,
+    ISA_TOTAL
+} Isa;
+
+const char *nomesIsa[ISA_TOTAL] = {"escalar", "sse4.1", "avx2", "avx512"};
+
+// Produtos 0.299 * r, 0.587 * g e 0.114 * b em double: somá-los na mesma ordem dá o
+// mesmo resultado da expressão original e não depende de contração em FMA
+double pesoR[256], pesoG[256], pesoB[256];
+
+// Mediana do miolo direto sobre os bytes intercalados: o vizinho kx de um byte está
+// kx * canais bytes adiante, então todos os canais são filtrados juntos. A mediana
+// (k-ésimo menor) é montada bit a bit contando quantos vizinhos ficam abaixo do
+// candidato, o que vetoriza sem desvios. A contagem em bytes vale até N = 15 (225 vizinhos).
+SEMPRE_INLINE void medianaBitsBloco(const unsigned char *src, unsigned char *dst, int rowSize, int yLocal, int i0, int canais, int n, const int len)
+{
+    int offset = n / 2;
+    int k = n * n / 2;
+    unsigned char m[BLOCO_MEDIANA], cand[BLOCO_MEDIANA], cont[BLOCO_MEDIANA];
+
+    for (int i = 0; i < len; i++)
+        m[i] = 0;
+
+    for (int bit = 7; bit >= 0; bit--)
     {
-        float num = (float)(cdf[i] - cdfMin);
-        float den = (float)(totalPixels - cdfMin);
-        int val = (int)round((num / den) * 255.0);
+        for (int i = 0; i < len; i++)
+        {
+            cand[i] = m[i] | (unsigned char)(1 << bit);
+            cont[i] = 0;
+        }
 
-        if (val < 0)
-            val = 0;
-        if (val > 255)
-            val = 255;
-        map[i] = (unsigned char)val;
+        for (int ky = -offset; ky <= offset; ky++)
+        {
+            for (int kx = -offset; kx <= offset; kx++)
+            {
+                const unsigned char *p = src + (size_t)(yLocal + ky) * rowSize + i0 + kx * canais;
+                for (int i = 0; i < len; i++)
+                    cont[i] += p[i] < cand[i];
+            }
+        }
+
+        for (int i = 0; i < len; i++)
+            m[i] = cont[i] <= k ? cand[i] : m[i];
     }
 
-    for (int i = 0; i < totalPixels; i++)
+    for (int i = 0; i < len; i++)
+        dst[i0 + i] = m[i];
+}
+
+// O mesmo para 17 <= N <= 255, em que a contagem passa de 255: ela segue em bytes, que
+// vetorizam melhor, mas é somada a total e zerada a cada 255 / N linhas da janela. Fica à
+// parte para não pesar nos registradores do caso comum.
+SEMPRE_INLINE void medianaBitsBlocoGrande(const unsigned char *src, unsigned char *dst, int rowSize, int yLocal, int i0, int canais, int n, const int len)
+{
+    int offset = n / 2;
+    uint32_t k = (uint32_t)n * n / 2;
+    int linhasPorVez = 255 / n;
+    unsigned char m[BLOCO_MEDIANA], cand[BLOCO_MEDIANA], cont[BLOCO_MEDIANA];
+    uint32_t total[BLOCO_MEDIANA];
+
+    for (int i = 0; i < len; i++)
+        m[i] = 0;
+
+    for (int bit = 7; bit >= 0; bit--)
     {
-        int idx = i * 3;
-        unsigned char oldVal = img->data[idx];
-        unsigned char newVal = map[oldVal];
+        for (int i = 0; i < len; i++)
+        {
+            cand[i] = m[i] | (unsigned char)(1 << bit);
+            cont[i] = 0;
+            total[i] = 0;
+        }
+
+        for (int ky0 = -offset; ky0 <= offset; ky0 += linhasPorVez)
+        {
+            int ky1 = ky0 + linhasPorVez - 1 < offset ? ky0 + linhasPorVez - 1 : offset;
+            for (int ky = ky0; ky <= ky1; ky++)
+            {
+                for (int kx = -offset; kx <= offset; kx++)
+                {
+                    const unsigned char *p = src + (size_t)(yLocal + ky) * rowSize + i0 + kx * canais;
+                    for (int i = 0; i < len; i++)
+                        cont[i] += p[i] < cand[i];
+                }
+            }
+            for (int i = 0; i < len; i++)
+            {
+                total[i] += cont[i];
+                cont[i] = 0;
+            }
+        }
 
-        img->data[idx] = newVal;
-        img->data[idx + 1] = newVal;
-        img->data[idx + 2] = newVal;
+        for (int i = 0; i < len; i++)
+            m[i] = total[i] <= k ? cand[i] : m[i];
     }
+
+    for (int i = 0; i < len; i++)
+        dst[i0 + i] = m[i];
 }
 
-int main()
+SEMPRE_INLINE void medianaBitsCorpo(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais, int n)
 {
-    char inputFilename[] = "../bitmaps/small.bmp";
-    char outputFilename[] = "output.bmp";
+    int yLocal = y - srcY0;
+    int rowSize = w * canais;
+    int inicio = x0 * canais;
+    int fim = x1 * canais;
 
-    Image *img = leBitMap(inputFilename);
-    if (!img)
+    // Blocos de tamanho fixo (o último se sobrepõe ao anterior) para o laço vetorizar inteiro
+    if (fim - inicio < BLOCO_MEDIANA)
     {
-        printf("Erro: Arquivo '%s' nao encontrado ou invalido.\n", inputFilename);
-        return 1;
+        if (fim > inicio && n <= 15)
+            medianaBitsBloco(src, dst, rowSize, yLocal, inicio, canais, n, fim - inicio);
+        else if (fim > inicio)
+            medianaBitsBlocoGrande(src, dst, rowSize, yLocal, inicio, canais, n, fim - inicio);
+    }
+    else
+    {
+        for (int i0 = inicio; i0 < fim; i0 += BLOCO_MEDIANA)
+        {
+            if (i0 + BLOCO_MEDIANA > fim)
+                i0 = fim - BLOCO_MEDIANA;
+            if (n <= 15)
+                medianaBitsBloco(src, dst, rowSize, yLocal, i0, canais, n, BLOCO_MEDIANA);
+            else
+                medianaBitsBlocoGrande(src, dst, rowSize, yLocal, i0, canais, n, BLOCO_MEDIANA);
+        }
     }
 
-    filtroMediana(img);
-    grayscale(img);
-    equalizacao(img);
+    // O alfa não é filtrado
+    if (canais == 4)
+    {
+        for (int x = x0; x < x1; x++)
+            dst[x * 4 + 3] = src[((size_t)yLocal * w + x) * 4 + 3];
+    }
+}
+
+SEMPRE_INLINE void grayscaleCorpo(unsigned char *data, size_t totalPixels, int canais)
+{
+    for (size_t i = 0; i < totalPixels; i++)
+    {
+        unsigned char *p = data + i * canais;
+        unsigned char gray = (unsigned char)(pesoR[p[2]] + pesoG[p[1]] + pesoB[p[0]]);
+        p[0] = gray;
+        p[1] = gray;
+        p[2] = gray;
+    }
+}
+
+// Acumula em histogram; quatro tabelas parciais evitam a dependência entre
+// incrementos seguidos do mesmo nível. As parciais são de 32 bits, então a entrada é
+// contada em blocos de BLOCO_HISTOGRAMA pixels, que não as estouram.
+#define BLOCO_HISTOGRAMA ((size_t)1 << 30)
+
+SEMPRE_INLINE void histogramaCorpo(const unsigned char *data, size_t totalPixels, int canais, uint64_t *histogram)
+{
+    for (size_t inicio = 0; inicio < totalPixels; inicio += BLOCO_HISTOGRAMA)
+    {
+        const unsigned char *bloco = data + inicio * canais;
+        size_t n = totalPixels - inicio < BLOCO_HISTOGRAMA ? totalPixels - inicio : BLOCO_HISTOGRAMA;
+        uint32_t parcial[4][256];
+        memset(parcial, 0, sizeof(parcial));
 
-    escreveBitMap(outputFilename, img);
-    printf("Imagem salva em '%s'.\n", outputFilename);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            parcial[0][bloco[i * canais]]++;
+            parcial[1][bloco[(i + 1) * canais]]++;
+            parcial[2][bloco[(i + 2) * canais]]++;
+            parcial[3][bloco[(i + 3) * canais]]++;
+        }
+        for (; i < n; i++)
+            parcial[0][bloco[i * canais]]++;
+
+        for (int v = 0; v < 256; v++)
+            histogram[v] += (uint64_t)parcial[0][v] + parcial[1][v] + parcial[2][v] + parcial[3][v];
+    }
+}
+
+SEMPRE_INLINE void aplicaLutCorpo(unsigned char *data, size_t totalPixels, int canais, const unsigned char *map)
+{
+    if (canais == 1)
+    {
+        for (size_t i = 0; i < totalPixels; i++)
+            data[i] = map[data[i]];
+        return;
+    }
+
+    for (size_t i = 0; i < totalPixels; i++)
+    {
+        unsigned char *p = data + i * canais;
+        unsigned char newVal = map[p[0]];
+        p[0] = newVal;
+        p[1] = newVal;
+        p[2] = newVal;
+    }
+}
+
+#define DEFINE_KERNELS(sufixo, alvo)                                                                       \
+    alvo void grayscale##sufixo(unsigned char *data, size_t totalPixels, int canais)                       \
+    {                                                                                                      \
+        grayscaleCorpo(data, totalPixels, canais);                                                         \
+    }                                                                                                      \
+    alvo void histograma##sufixo(const unsigned char *data, size_t totalPixels, int canais,                \
+                                 uint64_t *histogram)                                                      \
+    {                                                                                                      \
+        histogramaCorpo(data, totalPixels, canais, histogram);                                             \
+    }                                                                                                      \
+    alvo void aplicaLut##sufixo(unsigned char *data, size_t totalPixels, int canais,                       \
+                                const unsigned char *map)                                                  \
+    {                                                                                                      \
+        aplicaLutCorpo(data, totalPixels, canais, map);                                                    \
+    }
+
+// A mediana escalar continua sendo a dos kernels por colunas ordenadas
+#define DEFINE_MEDIANA(sufixo, alvo)                                                                       \
+    alvo void medianaBits##sufixo(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y,  \
+                                  int x0, int x1, int canais, int n)                                       \
+    {                                                                                                      \
+        medianaBitsCorpo(src, srcY0, dst, w, y, x0, x1, canais, n);                                        \
+    }
+
+DEFINE_KERNELS(Escalar, )
+#ifdef ISA_X86
+DEFINE_KERNELS(SSE41, __attribute__((target("sse4.1"))))
+DEFINE_KERNELS(AVX2, __attribute__((target("avx2"))))
+DEFINE_KERNELS(AVX512, __attribute__((target("avx512f,avx512bw"))))
+DEFINE_MEDIANA(SSE41, __attribute__((target("sse4.1"))))
+DEFINE_MEDIANA(AVX2, __attribute__((target("avx2"))))
+DEFINE_MEDIANA(AVX512, __attribute__((target("avx512f,avx512bw"))))
+#endif
+
+typedef struct
+{
+    Isa isa;
+    // NULL: usa os kernels por colunas ordenadas (ou o qsort genérico)
+    void (*mediana)(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1, int canais, int n);
+    void (*grayscale)(unsigned char *data, size_t totalPixels, int canais);
+    void (*histograma)(const unsigned char *data, size_t totalPixels, int canais, uint64_t *histogram);
+    void (*aplicaLut)(unsigned char *data, size_t totalPixels, int canais, const unsigned char *map);
+} Kernels;
+
+Kernels kernels = {ISA_ESCALAR, NULL, grayscaleEscalar, histogramaEscalar, aplicaLutEscalar};
+
+int isaSuportada(Isa isa)
+{
+    if (isa == ISA_ESCALAR)
+        return 1;
+#ifdef ISA_X86
+    __builtin_cpu_init();
+    if (isa == ISA_SSE41)
+        return __builtin_cpu_supports("sse4.1");
+    if (isa == ISA_AVX2)
+        return __builtin_cpu_supports("avx2");
+    if (isa == ISA_AVX512)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+    return 0;
+}
+
+int leIsa(const char *nome, Isa *isa)
+{
+    for (int i = 0; i < ISA_TOTAL; i++)
+    {
+        if (strcmp(nome, nomesIsa[i]) == 0)
+        {
+            *isa = (Isa)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+Isa melhorIsa()
+{
+    for (int i = ISA_TOTAL - 1; i > ISA_ESCALAR; i--)
+    {
+        if (isaSuportada((Isa)i))
+            return (Isa)i;
+    }
+    return ISA_ESCALAR;
+}
+
+// Retorna 0 se a CPU não suporta a ISA pedida
+int selecionaKernels(Isa isa)
+{
+    if (!isaSuportada(isa))
+        return 0;
+
+    for (int i = 0; i < 256; i++)
+    {
+        pesoR[i] = 0.299 * i;
+        pesoG[i] = 0.587 * i;
+        pesoB[i] = 0.114 * i;
+    }
+
+    Kernels escolhidos = {ISA_ESCALAR, NULL, grayscaleEscalar, histogramaEscalar, aplicaLutEscalar};
+#ifdef ISA_X86
+    if (isa == ISA_SSE41)
+        escolhidos = (Kernels){isa, medianaBitsSSE41, grayscaleSSE41, histogramaSSE41, aplicaLutSSE41};
+    else if (isa == ISA_AVX2)
+        escolhidos = (Kernels){isa, medianaBitsAVX2, grayscaleAVX2, histogramaAVX2, aplicaLutAVX2};
+    else if (isa == ISA_AVX512)
+        escolhidos = (Kernels){isa, medianaBitsAVX512, grayscaleAVX512, histogramaAVX512, aplicaLutAVX512};
+#endif
+    kernels = escolhidos;
+    return 1;
+}
+
+// Pixels próximos da borda: a janela é completada conforme o modo escolhido
+void medianaBorda(const unsigned char *src, int srcY0, unsigned char *dst, int w, int h, int y, int x0, int x1, int offset, int canais,
+                  ModoBorda modo, unsigned char valorBorda,
+                  unsigned char *winB, unsigned char *winG, unsigned char *winR)
+{
+    int window_size = (2 * offset + 1) * (2 * offset + 1);
+
+    for (int x = x0; x < x1; x++)
+    {
+        size_t center_idx = ((size_t)(y - srcY0) * w + x) * canais;
+
+        if (modo == BORDA_COPIAR)
+        {
+            memcpy(&dst[x * canais], &src[center_idx], canais);
+            continue;
+        }
+
+        int count = 0;
+        for (int ky = -offset; ky <= offset; ky++)
+        {
+            int ny = indiceBorda(y + ky, h, modo);
+            for (int kx = -offset; kx <= offset; kx++)
+            {
+                int nx = indiceBorda(x + kx, w, modo);
+                if (ny < 0 || nx < 0)
+                {
+                    winB[count] = valorBorda;
+                    winG[count] = valorBorda;
+                    winR[count] = valorBorda;
+                }
+                else
+                {
+                    size_t in_idx = ((size_t)(ny - srcY0) * w + nx) * canais;
+                    winB[count] = src[in_idx];
+                    if (canais > 1)
+                    {
+                        winG[count] = src[in_idx + 1];
+                        winR[count] = src[in_idx + 2];
+                    }
+                }
+                count++;
+            }
+        }
+
+        dst[x * canais] = mediana(winB, window_size);
+        if (canais > 1)
+        {
+            dst[x * canais + 1] = mediana(winG, window_size);
+            dst[x * canais + 2] = mediana(winR, window_size);
+        }
+        if (canais == 4)
+            dst[x * canais + 3] = src[center_idx + 3];
+    }
+}
+
+double relogio()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Regiões planas (--plano): a saída é dividida em blocos de LADO_PLANO x LADO_PLANO pixels a
+// partir da linha y0, e um resumo marca os blocos em que cada canal de cor varia no máximo
+// toleranciaPlano níveis em toda a vizinhança que as janelas dos seus pixels alcançam (o bloco
+// mais offset de cada lado). Ali a mediana não ordena nada: com tolerância 0 ela é o próprio
+// pixel central, que é copiado; acima de 0 a cópia fica a no máximo toleranciaPlano níveis
+// dela. Só o interior é pulado, então as bordas seguem o modo de borda normalmente.
+#define LADO_PLANO 32
+
+typedef struct
+{
+    unsigned char *plano; // Um por bloco, em ordem de linha
+    int y0;
+    int blocosX;
+    int blocosY;
+} Planos;
+
+int toleranciaPlano = -1; // -1: desligado
+uint64_t blocosPlanos = 0, blocosTotal = 0;
+double tempoPlanos = 0; // Gasto montando os resumos
+
+// Se cada canal de cor do retângulo [x0, x1) x [y0, y1) varia até tolerancia; para no
+// primeiro pixel que passa dela, então blocos com textura custam poucas leituras
+static int retanguloPlano(const unsigned char *src, int srcY0, int w, int x0, int x1, int y0, int y1, int canais,
+                          int tolerancia)
+{
+    int cores = canais == 4 ? 3 : canais;
+    const unsigned char *primeiro = src + ((size_t)(y0 - srcY0) * w + x0) * canais;
+    int minimo[3], maximo[3];
+    for (int c = 0; c < cores; c++)
+        minimo[c] = maximo[c] = primeiro[c];
+
+    for (int y = y0; y < y1; y++)
+    {
+        const unsigned char *linha = src + ((size_t)(y - srcY0) * w + x0) * canais;
+        for (int x = 0; x < x1 - x0; x++)
+        {
+            for (int c = 0; c < cores; c++)
+            {
+                int v = linha[x * canais + c];
+                if (v < minimo[c])
+                    minimo[c] = v;
+                if (v > maximo[c])
+                    maximo[c] = v;
+                if (maximo[c] - minimo[c] > tolerancia)
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Resumo das linhas de saída [y0, y1); src precisa ter também as offset linhas de cada lado
+Planos *marcaPlanos(const unsigned char *src, int srcY0, int w, int h, int y0, int y1, int offset, int canais)
+{
+    double inicio = relogio();
+    Planos *p = (Planos *)malloc(sizeof(Planos));
+    p->y0 = y0;
+    p->blocosX = (w + LADO_PLANO - 1) / LADO_PLANO;
+    p->blocosY = (y1 - y0 + LADO_PLANO - 1) / LADO_PLANO;
+    p->plano = (unsigned char *)malloc((size_t)p->blocosX * p->blocosY);
+
+    uint64_t planos = 0;
+    for (int by = 0; by < p->blocosY; by++)
+    {
+        int ry0 = y0 + by * LADO_PLANO - offset;
+        int ry1 = (y0 + (by + 1) * LADO_PLANO < y1 ? y0 + (by + 1) * LADO_PLANO : y1) + offset;
+        if (ry0 < 0)
+            ry0 = 0;
+        if (ry1 > h)
+            ry1 = h;
+        for (int bx = 0; bx < p->blocosX; bx++)
+        {
+            int rx0 = bx * LADO_PLANO - offset < 0 ? 0 : bx * LADO_PLANO - offset;
+            int rx1 = (bx + 1) * LADO_PLANO + offset > w ? w : (bx + 1) * LADO_PLANO + offset;
+            int plano = retanguloPlano(src, srcY0, w, rx0, rx1, ry0, ry1, canais, toleranciaPlano);
+            p->plano[(size_t)by * p->blocosX + bx] = (unsigned char)plano;
+            planos += plano;
+        }
+    }
+    blocosPlanos += planos;
+    blocosTotal += (uint64_t)p->blocosX * p->blocosY;
+    tempoPlanos += relogio() - inicio;
+    return p;
+}
+
+void liberaPlanos(Planos *p)
+{
+    if (!p)
+        return;
+    free(p->plano);
+    free(p);
+}
+
+// A economia estimada supõe que cada bloco copiado custaria o mesmo que um ordenado e
+// desconta o tempo de montar o resumo; pode sair negativa em imagens sem regiões planas
+void imprimePlanos(uint64_t planos, uint64_t total, double resumo, double mediana)
+{
+    double economia = planos < total ? mediana * planos / (total - planos) - resumo : 0.0;
+    printf("Regioes planas: %llu de %llu blocos (%.1f%%) copiados sem ordenar; resumo %.4f s, mediana %.4f s, "
+           "economia estimada %.4f s\n",
+           (unsigned long long)planos, (unsigned long long)total, total ? 100.0 * planos / total : 0.0, resumo, mediana,
+           economia);
+}
+
+// O interior [x0, x1) da linha y, pelo kernel mais rápido disponível
+static inline void medianaTrecho(const unsigned char *src, int srcY0, unsigned char *dst, int w, int y, int x0, int x1,
+                                 int offset, int canais, unsigned char *winB, unsigned char *winG, unsigned char *winR)
+{
+    // Os kernels SIMD contam os vizinhos até N = 255
+    KernelMediana kernel = kernelMediana(offset);
+    if (kernels.mediana && offset <= 127)
+        kernels.mediana(src, srcY0, dst, w, y, x0, x1, canais, 2 * offset + 1);
+    else if (kernel)
+        kernel(src, srcY0, dst, w, y, x0, x1, canais);
+    else
+        medianaInterior(src, srcY0, dst, w, y, x0, x1, offset, canais, winB, winG, winR);
+}
+
+// Filtra a linha global y: as colunas de borda e o miolo são tratados por kernels separados.
+// planos pode ser NULL; com ele, os trechos de blocos planos do interior são só copiados
+void filtraLinha(const unsigned char *src, int srcY0, unsigned char *dst, int w, int h, int y, int offset, int canais,
+                 ModoBorda modo, unsigned char valorBorda,
+                 unsigned char *winB, unsigned char *winG, unsigned char *winR, const Planos *planos)
+{
+    if (y < offset || y >= h - offset || w <= 2 * offset)
+    {
+        medianaBorda(src, srcY0, dst, w, h, y, 0, w, offset, canais, modo, valorBorda, winB, winG, winR);
+        return;
+    }
+
+    medianaBorda(src, srcY0, dst, w, h, y, 0, offset, offset, canais, modo, valorBorda, winB, winG, winR);
+
+    int x1 = w - offset;
+    if (!planos)
+        medianaTrecho(src, srcY0, dst, w, y, offset, x1, offset, canais, winB, winG, winR);
+    else
+    {
+        // Blocos seguidos do mesmo tipo vão num trecho só
+        const unsigned char *linhaPlanos = planos->plano + (size_t)((y - planos->y0) / LADO_PLANO) * planos->blocosX;
+        int x = offset;
+        while (x < x1)
+        {
+            int plano = linhaPlanos[x / LADO_PLANO];
+            int fim = (x / LADO_PLANO + 1) * LADO_PLANO;
+            while (fim < x1 && linhaPlanos[fim / LADO_PLANO] == plano)
+                fim += LADO_PLANO;
+            if (fim > x1)
+                fim = x1;
+            if (plano)
+                memcpy(dst + x * canais, src + ((size_t)(y - srcY0) * w + x) * canais, (size_t)(fim - x) * canais);
+            else
+                medianaTrecho(src, srcY0, dst, w, y, x, fim, offset, canais, winB, winG, winR);
+            x = fim;
+        }
+    }
+
+    medianaBorda(src, srcY0, dst, w, h, y, x1, w, offset, canais, modo, valorBorda, winB, winG, winR);
+}
+
+// Filtra as linhas globais [y0, y1) de buf no próprio lugar; buf começa na linha global bufY0.
+// Só as N linhas originais da janela ficam guardadas, num anel em que cada linha é gravada
+// em duas posições (j % N e j % N + N): assim as N linhas estão sempre contíguas e os
+// kernels leem o anel como se fosse a imagem. acima/abaixo são cópias das linhas de halo
+// fora de [y0, y1) quando outra thread pode sobrescrevê-las; NULL lê direto de buf.
+void medianaNoLugar(unsigned char *buf, int bufY0, int y0, int y1, const unsigned char *acima, const unsigned char *abaixo,
+                    int w, int h, int n_filter, int canais, ModoBorda modo, unsigned char valorBorda,
+                    unsigned char *winB, unsigned char *winG, unsigned char *winR, const Planos *planos)
+{
+    int offset = n_filter / 2;
+    int linhasAnel = 2 * offset + 1;
+    int rowSize = w * canais;
+    int primeira = y0 - offset < 0 ? 0 : y0 - offset;
+    unsigned char *anel = (unsigned char *)alocaBuffer((size_t)2 * linhasAnel * rowSize);
+
+    int proxima = primeira;
+    for (int y = y0; y < y1; y++)
+    {
+        int fim = y + offset + 1 > h ? h : y + offset + 1;
+        for (; proxima < fim; proxima++)
+        {
+            const unsigned char *original;
+            if (proxima < y0 && acima)
+                original = acima + (size_t)(proxima - primeira) * rowSize;
+            else if (proxima >= y1 && abaixo)
+                original = abaixo + (size_t)(proxima - y1) * rowSize;
+            else
+                original = buf + (size_t)(proxima - bufY0) * rowSize;
+
+            int slot = proxima % linhasAnel;
+            memcpy(anel + slot * rowSize, original, rowSize);
+            memcpy(anel + (slot + linhasAnel) * rowSize, original, rowSize);
+        }
+
+        int topo = y - offset < 0 ? 0 : y - offset;
+        filtraLinha(anel + (topo % linhasAnel) * rowSize, topo, buf + (size_t)(y - bufY0) * rowSize, w, h, y, offset, canais,
+                    modo, valorBorda, winB, winG, winR, planos);
+    }
+
+    liberaBuffer(anel);
+}
+
+void filtroMediana(Image *img, int n_filter, ModoBorda modo, unsigned char valorBorda, int inPlace)
+{
+    int w = img->width;
+    int h = img->height;
+    int rowSize = w * img->canais;
+
+    int offset = n_filter / 2;
+    int windowSize = n_filter * n_filter;
+
+    // As três janelas num só buffer, cada uma numa linha de cache própria
+    int passo = (windowSize + ALINHAMENTO_BUFFER - 1) / ALINHAMENTO_BUFFER * ALINHAMENTO_BUFFER;
+    unsigned char *janelas = (unsigned char *)alocaBuffer(3 * passo);
+    unsigned char *windowR = janelas;
+    unsigned char *windowG = janelas + passo;
+    unsigned char *windowB = janelas + 2 * passo;
+
+    // O resumo vem da imagem original, antes que o modo in-place comece a sobrescrevê-la
+    double inicio = relogio();
+    uint64_t planosAntes = blocosPlanos, totalAntes = blocosTotal;
+    double resumoAntes = tempoPlanos;
+    Planos *planos = toleranciaPlano >= 0 ? marcaPlanos(img->data, 0, w, h, 0, h, offset, img->canais) : NULL;
+
+    if (inPlace)
+    {
+        medianaNoLugar(img->data, 0, 0, h, NULL, NULL, w, h, n_filter, img->canais, modo, valorBorda, windowB, windowG, windowR, planos);
+    }
+    else
+    {
+        unsigned char *newData = (unsigned char *)alocaBuffer((size_t)rowSize * h);
+        for (int y = 0; y < h; y++)
+        {
+            filtraLinha(img->data, 0, newData + (size_t)y * rowSize, w, h, y, offset, img->canais, modo, valorBorda, windowB, windowG, windowR, planos);
+        }
+        liberaBuffer(img->data);
+        img->data = newData;
+    }
+
+    if (planos)
+    {
+        double resumo = tempoPlanos - resumoAntes;
+        imprimePlanos(blocosPlanos - planosAntes, blocosTotal - totalAntes, resumo, relogio() - inicio - resumo);
+        liberaPlanos(planos);
+    }
+
+    liberaBuffer(janelas);
+}
+
+void grayscale(Image *img)
+{
+    // 8 bits já está em tons de cinza
+    if (img->canais == 1)
+        return;
+
+    kernels.grayscale(img->data, (size_t)img->width * img->height, img->canais);
+}
+
+// Mapa da equalização a partir do histograma de totalPixels pixels
+void mapaEqualizacao(const uint64_t *histogram, uint64_t totalPixels, unsigned char *map)
+{
+    uint64_t cdf[256] = {0};
+    cdf[0] = histogram[0];
+    for (int i = 1; i < 256; i++)
+    {
+        cdf[i] = cdf[i - 1] + histogram[i];
+    }
+
+    uint64_t cdfMin = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        if (cdf[i] > 0)
+        {
+            cdfMin = cdf[i];
+            break;
+        }
+    }
+
+    for (int i = 0; i < 256; i++)
+    {
+        // Sem sinal, cdf[i] - cdfMin daria a volta abaixo do primeiro nível presente
+        if (cdf[i] <= cdfMin)
+        {
+            map[i] = 0;
+            continue;
+        }
+        float num = (float)(cdf[i] - cdfMin);
+        float den = (float)(totalPixels - cdfMin);
+        int val = (int)round((num / den) * 255.0);
+
+        if (val < 0)
+            val = 0;
+        if (val > 255)
+            val = 255;
+        map[i] = (unsigned char)val;
+    }
+}
+
+// Equaliza e deixa em map o mapa usado
+void equalizacaoMapa(Image *img, unsigned char *map)
+{
+    size_t totalPixels = (size_t)img->width * img->height;
+
+    uint64_t histogram[256] = {0};
+    kernels.histograma(img->data, totalPixels, img->canais, histogram);
+
+    mapaEqualizacao(histogram, totalPixels, map);
+
+    kernels.aplicaLut(img->data, totalPixels, img->canais, map);
+}
+
+void equalizacao(Image *img)
+{
+    unsigned char map[256];
+    equalizacaoMapa(img, map);
+}
+
+// Uma linha a cada PASSO_AMOSTRA entra na estimativa do histograma global
+#define PASSO_AMOSTRA 16
+
+// Estimativa barata do histograma global: só as linhas amostradas são lidas e convertidas
+// para cinza, sem a mediana, que quase não muda a distribuição.
+// Retorna os pixels contados (0 em erro).
+uint64_t histogramaAmostrado(const char *filename, uint64_t *histogram)
+{
+    int dx, dy;
+    Image *img = leBitMapRegiao(filename, 0, 0, 0, 0, 0, 0, PASSO_AMOSTRA, &dx, &dy);
+    if (!img)
+        return 0;
+
+    grayscale(img);
+    size_t amostras = (size_t)img->width * img->height;
+    kernels.histograma(img->data, amostras, img->canais, histogram);
+
+    liberaBuffer(img->data);
+    free(img);
+    return amostras;
+}
+
+// Contêiner em tiles (.eqt): a imagem já filtrada e em tons de cinza, ou seja, a entrada da
+// equalização, guardada em tiles quadrados independentes, com o histograma de cada tile num
+// índice logo depois do cabeçalho. O mapa da equalização de qualquer região alinhada aos tiles
+// sai só do índice, e cada tile pode ser lido sozinho.
+//
+//   "EQT1", largura, altura, canais, lado do tile, topDown        (uint32 cada)
+//   índice, tiles em ordem de linha: offset (uint64) + histograma (256 x uint32)
+//   dados: as linhas de cada tile contíguas; os tiles da última coluna/linha podem ser menores
+#define MAGICO_TILES "EQT1"
+#define LADO_TILE 128
+#define CABECALHO_TILES (4 + 5 * 4)
+#define ENTRADA_INDICE_TILES (8 + 256 * 4)
+
+typedef struct
+{
+    uint64_t offset;
+    uint32_t histograma[256];
+} IndiceTile;
+
+typedef struct
+{
+    FILE *f;
+    int width;
+    int height;
+    int canais;
+    int lado;
+    int topDown;
+    int tilesX;
+    int tilesY;
+    IndiceTile *indice;
+} ArquivoTiles;
+
+int ehArquivoTiles(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return 0;
+    char magico[4];
+    int ok = fread(magico, 1, 4, f) == 4 && memcmp(magico, MAGICO_TILES, 4) == 0;
+    fclose(f);
+    return ok;
+}
+
+// Posição e tamanho do tile (tx, ty) em pixels
+void retanguloTile(int w, int h, int lado, int tx, int ty, int *x0, int *y0, int *tw, int *th)
+{
+    *x0 = tx * lado;
+    *y0 = ty * lado;
+    *tw = w - *x0 < lado ? w - *x0 : lado;
+    *th = h - *y0 < lado ? h - *y0 : lado;
+}
+
+int gravaTiles(const char *filename, Image *img, int lado)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        printf("Erro ao criar arquivo %s\n", filename);
+        return 0;
+    }
+
+    int w = img->width;
+    int h = img->height;
+    int canais = img->canais;
+    int tilesX = (w + lado - 1) / lado;
+    int tilesY = (h + lado - 1) / lado;
+    int nTiles = tilesX * tilesY;
+
+    IndiceTile *indice = (IndiceTile *)alocaBuffer(nTiles * sizeof(IndiceTile));
+    uint64_t offset = CABECALHO_TILES + (uint64_t)nTiles * ENTRADA_INDICE_TILES;
+    for (int t = 0; t < nTiles; t++)
+    {
+        int x0, y0, tw, th;
+        retanguloTile(w, h, lado, t % tilesX, t / tilesX, &x0, &y0, &tw, &th);
+
+        uint64_t histogram[256] = {0};
+        for (int y = y0; y < y0 + th; y++)
+            kernels.histograma(img->data + ((size_t)y * w + x0) * canais, tw, canais, histogram);
+
+        indice[t].offset = offset;
+        for (int v = 0; v < 256; v++)
+            indice[t].histograma[v] = histogram[v];
+        offset += (uint64_t)tw * th * canais;
+    }
+
+    uint32_t cabecalho[5] = {w, h, canais, lado, img->topDown};
+    fwrite(MAGICO_TILES, 1, 4, f);
+    fwrite(cabecalho, sizeof(uint32_t), 5, f);
+    for (int t = 0; t < nTiles; t++)
+    {
+        fwrite(&indice[t].offset, sizeof(uint64_t), 1, f);
+        fwrite(indice[t].histograma, sizeof(uint32_t), 256, f);
+    }
+
+    for (int t = 0; t < nTiles; t++)
+    {
+        int x0, y0, tw, th;
+        retanguloTile(w, h, lado, t % tilesX, t / tilesX, &x0, &y0, &tw, &th);
+        for (int y = y0; y < y0 + th; y++)
+            fwrite(img->data + ((size_t)y * w + x0) * canais, 1, (size_t)tw * canais, f);
+    }
+
+    liberaBuffer(indice);
+    fclose(f);
+    return 1;
+}
+
+void fechaTiles(ArquivoTiles *t)
+{
+    fclose(t->f);
+    liberaBuffer(t->indice);
+    free(t);
+}
+
+ArquivoTiles *abreTiles(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        printf("Erro ao abrir arquivo %s\n", filename);
+        return NULL;
+    }
+
+    char magico[4];
+    uint32_t cabecalho[5];
+    if (fread(magico, 1, 4, f) != 4 || memcmp(magico, MAGICO_TILES, 4) != 0 ||
+        fread(cabecalho, sizeof(uint32_t), 5, f) != 5)
+    {
+        printf("Arquivo não é um .eqt válido.\n");
+        fclose(f);
+        return NULL;
+    }
+
+    // Os campos vêm do arquivo: conferidos antes de qualquer conta ou alocação. O lado tem o
+    // mesmo limite de --tile, para o histograma de um tile caber em 32 bits.
+    uint32_t w = cabecalho[0], h = cabecalho[1], canais = cabecalho[2], lado = cabecalho[3];
+    if (w == 0 || h == 0 || w > INT32_MAX || h > INT32_MAX || (canais != 1 && canais != 3 && canais != 4) ||
+        lado == 0 || lado > 65535 || cabecalho[4] > 1)
+    {
+        printf("Cabeçalho de .eqt inválido.\n");
+        fclose(f);
+        return NULL;
+    }
+
+    uint64_t nTiles = (uint64_t)((w + lado - 1) / lado) * ((h + lado - 1) / lado);
+    fseek(f, 0, SEEK_END);
+    long tamanho = ftell(f);
+    fseek(f, CABECALHO_TILES, SEEK_SET);
+    uint64_t inicioDados = CABECALHO_TILES + nTiles * ENTRADA_INDICE_TILES;
+    if (tamanho < 0 || nTiles > INT32_MAX / sizeof(IndiceTile) || inicioDados > (uint64_t)tamanho)
+    {
+        printf("Índice de .eqt truncado.\n");
+        fclose(f);
+        return NULL;
+    }
+
+    ArquivoTiles *t = (ArquivoTiles *)malloc(sizeof(ArquivoTiles));
+    t->f = f;
+    t->width = w;
+    t->height = h;
+    t->canais = canais;
+    t->lado = lado;
+    t->topDown = cabecalho[4];
+    t->tilesX = (t->width + t->lado - 1) / t->lado;
+    t->tilesY = (t->height + t->lado - 1) / t->lado;
+    t->indice = (IndiceTile *)alocaBuffer(nTiles * sizeof(IndiceTile));
+
+    // Cada tile precisa estar inteiro no arquivo, depois do índice, e o histograma dele
+    // precisa somar os seus pixels, senão o mapa sairia de contagens inventadas
+    for (int i = 0; i < (int)nTiles; i++)
+    {
+        int x0, y0, tw, th;
+        retanguloTile(t->width, t->height, t->lado, i % t->tilesX, i / t->tilesX, &x0, &y0, &tw, &th);
+        uint64_t bytes = (uint64_t)tw * th * canais;
+        uint64_t soma = 0;
+        int ok = fread(&t->indice[i].offset, sizeof(uint64_t), 1, f) == 1 &&
+                 fread(t->indice[i].histograma, sizeof(uint32_t), 256, f) == 256 &&
+                 t->indice[i].offset >= inicioDados && t->indice[i].offset <= (uint64_t)tamanho &&
+                 bytes <= (uint64_t)tamanho - t->indice[i].offset;
+        for (int v = 0; ok && v < 256; v++)
+            soma += t->indice[i].histograma[v];
+        if (!ok || soma != (uint64_t)tw * th)
+        {
+            printf("Tile %d do .eqt inválido.\n", i);
+            fechaTiles(t);
+            return NULL;
+        }
+    }
+    return t;
+}
+
+// Soma ao histograma os tiles inteiramente dentro do retângulo, direto do índice
+void histogramaIndice(const ArquivoTiles *t, int rx, int ry, int rw, int rh, uint64_t *histogram)
+{
+    for (int ty = 0; ty < t->tilesY; ty++)
+    {
+        for (int tx = 0; tx < t->tilesX; tx++)
+        {
+            int x0, y0, tw, th;
+            retanguloTile(t->width, t->height, t->lado, tx, ty, &x0, &y0, &tw, &th);
+            if (x0 >= rx && y0 >= ry && x0 + tw <= rx + rw && y0 + th <= ry + rh)
+            {
+                const uint32_t *hist = t->indice[ty * t->tilesX + tx].histograma;
+                for (int v = 0; v < 256; v++)
+                    histogram[v] += hist[v];
+            }
+        }
+    }
+}
+
+// Lê só os tiles que tocam o retângulo (em linhas de memória) e devolve o recorte.
+// histogram recebe o histograma do recorte: os tiles inteiros vêm do índice e só os
+// pixels dos tiles cortados pela borda do retângulo são contados.
+Image *carregaTiles(ArquivoTiles *t, int rx, int ry, int rw, int rh, uint64_t *histogram)
+{
+    int canais = t->canais;
+    Image *img = (Image *)malloc(sizeof(Image));
+    img->width = rw;
+    img->height = rh;
+    img->canais = canais;
+    img->topDown = t->topDown;
+    img->data = (unsigned char *)alocaBuffer((size_t)rw * rh * canais);
+
+    // Tiles maiores que a imagem só ocupam o tamanho dela
+    size_t maiorTile = (size_t)(t->lado < t->width ? t->lado : t->width) * (t->lado < t->height ? t->lado : t->height) * canais;
+    unsigned char *tile = (unsigned char *)alocaBuffer(maiorTile);
+    histogramaIndice(t, rx, ry, rw, rh, histogram);
+    int falhou = 0;
+
+    for (int ty = ry / t->lado; ty <= (ry + rh - 1) / t->lado; ty++)
+    {
+        for (int tx = rx / t->lado; tx <= (rx + rw - 1) / t->lado; tx++)
+        {
+            int x0, y0, tw, th;
+            retanguloTile(t->width, t->height, t->lado, tx, ty, &x0, &y0, &tw, &th);
+            size_t bytes = (size_t)tw * th * canais;
+            if (fseek(t->f, t->indice[ty * t->tilesX + tx].offset, SEEK_SET) != 0 || fread(tile, 1, bytes, t->f) != bytes)
+            {
+                falhou = 1;
+                continue;
+            }
+
+            int cx0 = x0 > rx ? x0 : rx;
+            int cx1 = x0 + tw < rx + rw ? x0 + tw : rx + rw;
+            int cy0 = y0 > ry ? y0 : ry;
+            int cy1 = y0 + th < ry + rh ? y0 + th : ry + rh;
+            int inteiro = cx0 == x0 && cx1 == x0 + tw && cy0 == y0 && cy1 == y0 + th;
+            for (int y = cy0; y < cy1; y++)
+            {
+                unsigned char *linha = img->data + ((size_t)(y - ry) * rw + (cx0 - rx)) * canais;
+                memcpy(linha, tile + ((size_t)(y - y0) * tw + (cx0 - x0)) * canais, (size_t)(cx1 - cx0) * canais);
+                if (!inteiro)
+                    kernels.histograma(linha, cx1 - cx0, canais, histogram);
+            }
+        }
+    }
+
+    liberaBuffer(tile);
+    if (falhou)
+    {
+        printf("Erro ao ler os tiles.\n");
+        liberaBuffer(img->data);
+        free(img);
+        return NULL;
+    }
+    return img;
+}
+
+// Equaliza um .eqt sem refazer mediana nem grayscale: o mapa vem do índice. Sem região,
+// a imagem inteira; com região (x, y a partir do canto superior esquerdo), só os tiles
+// que a tocam são lidos, e o mapa é o da região ou, com mapaGlobal, o da imagem toda.
+Image *equalizaTiles(const char *filename, int temRegiao, int rx, int ry, int rw, int rh, int mapaGlobal)
+{
+    ArquivoTiles *t = abreTiles(filename);
+    if (!t)
+        return NULL;
+
+    if (!temRegiao)
+    {
+        rx = 0;
+        ry = 0;
+        rw = t->width;
+        rh = t->height;
+    }
+    if (rx < 0 || ry < 0 || rw <= 0 || rh <= 0 || rx + rw > t->width || ry + rh > t->height)
+    {
+        printf("Regiao fora da imagem (%dx%d).\n", t->width, t->height);
+        fechaTiles(t);
+        return NULL;
+    }
+
+    // De baixo para cima, a linha 0 da memória é a última da imagem
+    int ryMemoria = t->topDown ? ry : t->height - ry - rh;
+
+    uint64_t histogram[256] = {0};
+    Image *img = carregaTiles(t, rx, ryMemoria, rw, rh, histogram);
+    if (!img)
+    {
+        fechaTiles(t);
+        return NULL;
+    }
+    uint64_t totalPixels = (uint64_t)rw * rh;
+    if (mapaGlobal)
+    {
+        memset(histogram, 0, sizeof(histogram));
+        histogramaIndice(t, 0, 0, t->width, t->height, histogram);
+        totalPixels = (uint64_t)t->width * t->height;
+    }
+
+    unsigned char map[256];
+    mapaEqualizacao(histogram, totalPixels, map);
+    kernels.aplicaLut(img->data, (size_t)rw * rh, img->canais, map);
+
+    fechaTiles(t);
+    return img;
+}
+
+// Microbenchmarks dos kernels sobre uma imagem sintética em memória (--bench)
+#define REPETICOES_BENCH 5
+#define MAX_RESULTADOS_BENCH 16
+#define BYTES_BANDA (64 * 1024 * 1024)
+
+typedef struct
+{
+    char nome[32];
+    double nsPixel;
+    double gbs;
+    double ciclosPixel;
+} ResultadoBench;
+
+// Ciclos do TSC (frequência nominal); 0 fora de x86
+uint64_t ciclosTsc()
+{
+#ifdef ISA_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+Image *imagemSintetica(int w, int h)
+{
+    Image *img = (Image *)malloc(sizeof(Image));
+    img->width = w;
+    img->height = h;
+    img->canais = 3;
+    img->topDown = 0;
+    img->data = (unsigned char *)alocaBuffer((size_t)w * h * 3);
+
+    // Gradiente com ruído, para a mediana não cair sempre no mesmo caso
+    uint32_t semente = 12345;
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w * 3; x++)
+        {
+            semente = semente * 1103515245 + 12345;
+            img->data[(size_t)y * w * 3 + x] = (unsigned char)((x / 3 + y) / 8 + (semente >> 24) / 4);
+        }
+    }
+    return img;
+}
+
+// Banda de memória medida com memcpy (leitura + escrita), melhor de algumas rodadas
+double medeBanda()
+{
+    unsigned char *a = (unsigned char *)alocaBuffer(BYTES_BANDA);
+    unsigned char *b = (unsigned char *)alocaBuffer(BYTES_BANDA);
+    memset(a, 1, BYTES_BANDA);
+    memset(b, 2, BYTES_BANDA);
+
+    double melhor = 1e30;
+    for (int rep = 0; rep < REPETICOES_BENCH; rep++)
+    {
+        double t0 = relogio();
+        memcpy(b, a, BYTES_BANDA);
+        double t = relogio() - t0;
+        if (t < melhor)
+            melhor = t;
+    }
+
+    liberaBuffer(a);
+    liberaBuffer(b);
+    return 2.0 * BYTES_BANDA / melhor / 1e9;
+}
+
+void registraBench(ResultadoBench *r, int *nResultados, const char *nome, double segundos, uint64_t ciclos,
+                   long pixels, double bytesPixel)
+{
+    ResultadoBench *res = &r[(*nResultados)++];
+    snprintf(res->nome, sizeof(res->nome), "%s", nome);
+    res->nsPixel = segundos * 1e9 / pixels;
+    res->gbs = bytesPixel * pixels / segundos / 1e9;
+    res->ciclosPixel = (double)ciclos / pixels;
+}
+
+// Roda preparo + execucao REPETICOES_BENCH vezes e registra a execução mais rápida
+#define MEDE_BENCH(nome, bytesPixel, preparo, execucao)                                                     \
+    do                                                                                                      \
+    {                                                                                                       \
+        double melhor = 1e30;                                                                               \
+        uint64_t melhorCiclos = 0;                                                                          \
+        for (int rep = 0; rep < REPETICOES_BENCH; rep++)                                                    \
+        {                                                                                                   \
+            preparo;                                                                                        \
+            double t0 = relogio();                                                                          \
+            uint64_t c0 = ciclosTsc();                                                                      \
+            execucao;                                                                                       \
+            uint64_t c1 = ciclosTsc();                                                                      \
+            double t = relogio() - t0;                                                                      \
+            if (t < melhor)                                                                                 \
+            {                                                                                               \
+                melhor = t;                                                                                 \
+                melhorCiclos = c1 - c0;                                                                     \
+            }                                                                                               \
+        }                                                                                                   \
+        registraBench(resultados, &nResultados, nome, melhor, melhorCiclos, pixels, bytesPixel);            \
+    } while (0)
+
+double buscaBaseline(const char *arquivo, const char *nome)
+{
+    FILE *f = fopen(arquivo, "r");
+    if (!f)
+        return -1.0;
+
+    char linha[128], chave[32];
+    double valor, encontrado = -1.0;
+    while (fgets(linha, sizeof(linha), f))
+    {
+        if (linha[0] != '#' && sscanf(linha, "%31s %lf", chave, &valor) == 2 && strcmp(chave, nome) == 0)
+            encontrado = valor;
+    }
+    fclose(f);
+    return encontrado;
+}
+
+// Retorna 2 se algum kernel ficou mais lento que a baseline além da tolerância (%)
+int executaBench(int w, int h, const char *baseline, const char *gravarBaseline, double tolerancia)
+{
+    ResultadoBench resultados[MAX_RESULTADOS_BENCH];
+    int nResultados = 0;
+    long pixels = (long)w * h;
+    const char *arquivoTemp = "bench_tmp.bmp";
+
+    Image *original = imagemSintetica(w, h);
+    Image *img = imagemSintetica(w, h);
+    size_t bytes = (size_t)w * h * 3;
+
+    printf("Imagem sintetica %dx%d (24 bits), kernels: %s, melhor de %d execucoes\n",
+           w, h, nomesIsa[kernels.isa], REPETICOES_BENCH);
+
+    int tamanhos[] = {3, 5, 7, 9};
+    for (int t = 0; t < 4; t++)
+    {
+        char nome[32];
+        snprintf(nome, sizeof(nome), "mediana%d", tamanhos[t]);
+        MEDE_BENCH(nome, 6.0, memcpy(img->data, original->data, bytes),
+                   filtroMediana(img, tamanhos[t], BORDA_COPIAR, 0, 0));
+    }
+
+    MEDE_BENCH("grayscale", 6.0, memcpy(img->data, original->data, bytes), grayscale(img));
+
+    uint64_t histogram[256];
+    MEDE_BENCH("histograma", 3.0, memset(histogram, 0, sizeof(histogram)),
+               kernels.histograma(img->data, (size_t)w * h, 3, histogram));
+
+    unsigned char map[256];
+    for (int i = 0; i < 256; i++)
+        map[i] = (unsigned char)(255 - i);
+    MEDE_BENCH("lut", 6.0, , kernels.aplicaLut(img->data, (size_t)w * h, 3, map));
+
+    MEDE_BENCH("escreveBitMap", 3.0, , escreveBitMap(arquivoTemp, original));
+
+    Image *lida = NULL;
+    MEDE_BENCH("leBitMap", 3.0,
+               if (lida) { liberaBuffer(lida->data); free(lida); },
+               lida = leBitMap(arquivoTemp));
+    liberaBuffer(lida->data);
+    free(lida);
+
+    // Depois da leitura, que não entende RLE8, sobre a imagem já equalizada pela LUT
+    MEDE_BENCH("escreveRle8", 3.0, , escreveBitMapRle8(arquivoTemp, img));
+    remove(arquivoTemp);
+
+    double banda = medeBanda();
+    printf("Banda de memoria (memcpy): %.2f GB/s\n\n", banda);
+    printf("%-14s %10s %9s %13s %8s %18s\n", "kernel", "ns/pixel", "GB/s", "ciclos/pixel", "%banda", "baseline ns/pixel");
+
+    int regressoes = 0;
+    for (int i = 0; i < nResultados; i++)
+    {
+        ResultadoBench *r = &resultados[i];
+        printf("%-14s %10.3f %9.2f %13.2f %7.1f%%", r->nome, r->nsPixel, r->gbs, r->ciclosPixel, 100.0 * r->gbs / banda);
+
+        double base = baseline ? buscaBaseline(baseline, r->nome) : -1.0;
+        if (base > 0)
+        {
+            double variacao = 100.0 * (r->nsPixel - base) / base;
+            printf(" %10.3f (%+.1f%%)", base, variacao);
+            if (variacao > tolerancia)
+            {
+                printf(" REGRESSAO");
+                regressoes++;
+            }
+        }
+        printf("\n");
+    }
+
+    if (gravarBaseline)
+    {
+        FILE *f = fopen(gravarBaseline, "w");
+        if (f)
+        {
+            fprintf(f, "# kernel ns/pixel (%dx%d, %s)\n", w, h, nomesIsa[kernels.isa]);
+            for (int i = 0; i < nResultados; i++)
+                fprintf(f, "%s %.4f\n", resultados[i].nome, resultados[i].nsPixel);
+            fclose(f);
+            printf("\nBaseline gravada em '%s'.\n", gravarBaseline);
+        }
+    }
+
+    if (regressoes > 0)
+        printf("\n%d kernel(s) acima da tolerancia de %.1f%%.\n", regressoes, tolerancia);
+
+    liberaBuffer(original->data);
+    free(original);
+    liberaBuffer(img->data);
+    free(img);
+    return regressoes > 0 ? 2 : 0;
+}
+
+// Confere os kernels de cada ISA suportada contra os escalares (--confere-isas), com 1, 3 e 4
+// canais: a mediana com N de 3 a 33 (a partir de N = 17 os kernels SIMD passam a contar os
+// vizinhos em duas etapas), o grayscale, o histograma e a LUT. Os mesmos bytes da imagem
+// sintética são lidos com cada número de canais. O cache depende disso para não separar as
+// chaves por ISA. Retorna 0 se todas conferem.
+int confereIsas()
+{
+    int tamanhos[] = {3, 5, 7, 9, 11, 15, 17, 19, 25, 33};
+    int nTamanhos = sizeof(tamanhos) / sizeof(tamanhos[0]);
+    int largura = 240, h = 48;
+    Image *base = imagemSintetica(largura, h);
+    size_t bytes = (size_t)largura * h * 3;
+    unsigned char *esperado = (unsigned char *)alocaBuffer(bytes);
+    unsigned char *obtido = (unsigned char *)alocaBuffer(bytes);
+    int maxJanela = 33 * 33;
+    unsigned char *janelas = (unsigned char *)alocaBuffer(3 * maxJanela);
+    unsigned char *winR = janelas, *winG = janelas + maxJanela, *winB = janelas + 2 * maxJanela;
+
+    int diferentes[ISA_TOTAL] = {0};
+    for (int canais = 1; canais <= 4; canais++)
+    {
+        if (canais == 2)
+            continue;
+        int w = largura * 3 / canais;
+        int rowSize = w * canais;
+        for (int t = 0; t < nTamanhos; t++)
+        {
+            int n = tamanhos[t];
+            selecionaKernels(ISA_ESCALAR);
+            for (int y = 0; y < h; y++)
+                filtraLinha(base->data, 0, esperado + (size_t)y * rowSize, w, h, y, n / 2, canais, BORDA_COPIAR, 0,
+                            winB, winG, winR, NULL);
+
+            for (int isa = ISA_SSE41; isa < ISA_TOTAL; isa++)
+            {
+                if (!selecionaKernels((Isa)isa))
+                    continue;
+                for (int y = 0; y < h; y++)
+                    filtraLinha(base->data, 0, obtido + (size_t)y * rowSize, w, h, y, n / 2, canais, BORDA_COPIAR, 0,
+                                winB, winG, winR, NULL);
+
+                int erradas = 0;
+                for (size_t i = 0; i < (size_t)rowSize * h; i++)
+                    erradas += esperado[i] != obtido[i];
+                if (erradas)
+                    printf("%-8s N=%d, %d canal(is): %d bytes diferentes da escalar\n", nomesIsa[isa], n, canais, erradas);
+                diferentes[isa] += erradas;
+            }
+        }
+
+        // Os estágios por pixel, sobre a imagem original (como no pipeline, 8 bits não passa
+        // pelo grayscale)
+        unsigned char map[256];
+        for (int i = 0; i < 256; i++)
+            map[i] = (unsigned char)(i * 7 + 3);
+        size_t pixels = (size_t)w * h;
+        uint64_t histEsperado[256] = {0};
+        selecionaKernels(ISA_ESCALAR);
+        memcpy(esperado, base->data, bytes);
+        if (canais > 1)
+            kernels.grayscale(esperado, pixels, canais);
+        kernels.histograma(esperado, pixels, canais, histEsperado);
+        kernels.aplicaLut(esperado, pixels, canais, map);
+        for (int isa = ISA_SSE41; isa < ISA_TOTAL; isa++)
+        {
+            if (!selecionaKernels((Isa)isa))
+                continue;
+            uint64_t hist[256] = {0};
+            memcpy(obtido, base->data, bytes);
+            if (canais > 1)
+                kernels.grayscale(obtido, pixels, canais);
+            kernels.histograma(obtido, pixels, canais, hist);
+            kernels.aplicaLut(obtido, pixels, canais, map);
+            if (memcmp(hist, histEsperado, sizeof(hist)) != 0 || memcmp(obtido, esperado, bytes) != 0)
+            {
+                printf("%-8s grayscale/histograma/LUT, %d canal(is): diferente da escalar\n", nomesIsa[isa], canais);
+                diferentes[isa]++;
+            }
+        }
+    }
+
+    int falhas = 0;
+    for (int isa = ISA_SSE41; isa < ISA_TOTAL; isa++)
+    {
+        if (!isaSuportada((Isa)isa))
+            printf("%-8s nao suportada por esta CPU\n", nomesIsa[isa]);
+        else if (!diferentes[isa])
+            printf("%-8s igual a escalar (mediana com N de 3 a 33, grayscale, histograma e LUT; 1, 3 e 4 canais)\n",
+                   nomesIsa[isa]);
+        falhas += diferentes[isa] > 0;
+    }
+
+    liberaBuffer(janelas);
+    liberaBuffer(obtido);
+    liberaBuffer(esperado);
+    liberaBuffer(base->data);
+    free(base);
+    return falhas ? 2 : 0;
+}
+
+// Teste de imagem grande (--teste-grande LxA[xC]): blocos de LADO_BLOCO x LADO_BLOCO pixels
+// com um nível dominante; 1 bloco em cada 256, espalhados em x e em y, e o último bloco do
+// buffer têm níveis que dependem da posição e do canal, então um erro de endereçamento em
+// qualquer eixo aparece. A partir de cerca de 2^31 pixels a contagem do dominante passa de 32
+// bits com sinal. Com N < LADO_BLOCO a janela toca no máximo 2x2 blocos e a mediana esperada
+// sai de quantos pixels de cada um ela cobre. O pipeline roda in-place (um único buffer da
+// imagem) e o resultado é conferido contra o histograma exato e o mapa esperado, pixel a
+// pixel. Retorna 0 se tudo confere.
+#define LADO_BLOCO 16
+
+// O último bloco de cada eixo absorve o resto, para nenhum ficar mais estreito que a janela
+int numBlocos(int tamanho)
+{
+    return tamanho / LADO_BLOCO > 0 ? tamanho / LADO_BLOCO : 1;
+}
+
+int blocoTeste(int p, int tamanho)
+{
+    int b = p / LADO_BLOCO;
+    return b < numBlocos(tamanho) ? b : numBlocos(tamanho) - 1;
+}
+
+unsigned char nivelBloco(int w, int h, int bx, int by, int c)
+{
+    unsigned int posicao = (unsigned int)bx * 7 + (unsigned int)by * 13;
+    int ultimo = bx == numBlocos(w) - 1 && by == numBlocos(h) - 1;
+    if (posicao % 256 != 0 && !ultimo)
+        return 128;
+    return (unsigned char)(20 + (posicao / 256 + 37 * c) % 100);
+}
+
+// Mediana do canal c no pixel (x, y) com borda copiar. A janela cobre no máximo 2x2 blocos:
+// nx0 das suas colunas e ny0 das linhas caem nos primeiros (a borda repete a primeira e a
+// última), e a mediana é o menor nível que acumula mais da metade da janela.
+unsigned char medianaBlocos(int w, int h, int x, int y, int c, int raio)
+{
+    int lado = 2 * raio + 1;
+    int bx0 = blocoTeste(x - raio < 0 ? 0 : x - raio, w), bx1 = blocoTeste(x + raio >= w ? w - 1 : x + raio, w);
+    int by0 = blocoTeste(y - raio < 0 ? 0 : y - raio, h), by1 = blocoTeste(y + raio >= h ? h - 1 : y + raio, h);
+    int nx0 = bx0 == bx1 ? lado : bx1 * LADO_BLOCO - (x - raio);
+    int ny0 = by0 == by1 ? lado : by1 * LADO_BLOCO - (y - raio);
+
+    unsigned char v[4] = {nivelBloco(w, h, bx0, by0, c), nivelBloco(w, h, bx1, by0, c),
+                          nivelBloco(w, h, bx0, by1, c), nivelBloco(w, h, bx1, by1, c)};
+    int n[4] = {nx0 * ny0, (lado - nx0) * ny0, nx0 * (lado - ny0), (lado - nx0) * (lado - ny0)};
+    int mediana = 256;
+    for (int i = 0; i < 4; i++)
+    {
+        int ate = 0;
+        for (int j = 0; j < 4; j++)
+        {
+            if (v[j] <= v[i])
+                ate += n[j];
+        }
+        if (n[i] > 0 && ate > lado * lado / 2 && v[i] < mediana)
+            mediana = v[i];
+    }
+    return (unsigned char)mediana;
+}
+
+// Cinza esperado no pixel (x, y), pela mesma expressão do kernel
+unsigned char cinzaBlocos(int w, int h, int canais, int x, int y, int raio)
+{
+    unsigned char b = medianaBlocos(w, h, x, y, 0, raio);
+    if (canais == 1)
+        return b;
+    return (unsigned char)(pesoR[medianaBlocos(w, h, x, y, 2, raio)] + pesoG[medianaBlocos(w, h, x, y, 1, raio)] + pesoB[b]);
+}
+
+// Bloco da linha y quando a janela não sai dele na vertical (linhas assim no mesmo bloco
+// saem iguais), ou -1 quando ela pega dois blocos
+int linhaSimples(int h, int raio, int y)
+{
+    int y0 = y - raio < 0 ? 0 : y - raio;
+    int y1 = y + raio >= h ? h - 1 : y + raio;
+    return blocoTeste(y0, h) == blocoTeste(y1, h) ? blocoTeste(y, h) : -1;
+}
+
+// Cinza esperado de toda a linha y: o nível de cada bloco, menos perto dos cantos, onde a
+// janela pega 2x2 blocos e nenhum deles tem maioria
+void cinzaLinhaBlocos(int w, int h, int canais, int raio, int y, unsigned char *cinza)
+{
+    int nbx = numBlocos(w);
+    for (int bx = 0; bx < nbx; bx++)
+    {
+        int x0 = bx * LADO_BLOCO;
+        int x1 = bx == nbx - 1 ? w : x0 + LADO_BLOCO;
+        memset(cinza + x0, cinzaBlocos(w, h, canais, x0, y, 0), x1 - x0);
+    }
+
+    if (linhaSimples(h, raio, y) >= 0)
+        return;
+    for (int bx = 1; bx < nbx; bx++)
+    {
+        for (int x = bx * LADO_BLOCO - raio; x < bx * LADO_BLOCO + raio; x++)
+            cinza[x] = cinzaBlocos(w, h, canais, x, y, raio);
+    }
+}
+
+// Preenche a linha y da imagem de teste; o alfa fica em 255
+void linhaBlocos(int w, int h, int canais, int y, unsigned char *linha)
+{
+    int nbx = numBlocos(w);
+    int by = blocoTeste(y, h);
+    for (int bx = 0; bx < nbx; bx++)
+    {
+        int x0 = bx * LADO_BLOCO;
+        int x1 = bx == nbx - 1 ? w : x0 + LADO_BLOCO;
+        unsigned char nivel[4] = {nivelBloco(w, h, bx, by, 0), nivelBloco(w, h, bx, by, 1), nivelBloco(w, h, bx, by, 2), 255};
+        if (canais == 1)
+            memset(linha + x0, nivel[0], x1 - x0);
+        else
+        {
+            for (int x = x0; x < x1; x++)
+                memcpy(linha + (size_t)x * canais, nivel, canais);
+        }
+    }
+}
+
+// Linha de saída esperada: o mapa aplicado ao cinza em todos os canais, com o alfa em 255
+void saidaLinhaBlocos(const unsigned char *cinza, int w, int canais, const unsigned char *mapa, unsigned char *saida)
+{
+    for (int x = 0; x < w; x++)
+    {
+        for (int c = 0; c < canais; c++)
+            saida[(size_t)x * canais + c] = c == 3 ? 255 : mapa[cinza[x]];
+    }
+}
+
+Image *imagemBlocos(int w, int h, int canais)
+{
+    Image *img = (Image *)malloc(sizeof(Image));
+    img->width = w;
+    img->height = h;
+    img->canais = canais;
+    img->topDown = 0;
+    img->data = (unsigned char *)alocaBuffer((size_t)w * h * canais);
+    if (!img->data)
+    {
+        free(img);
+        return NULL;
+    }
+
+    size_t rowSize = (size_t)w * canais;
+    for (int y = 0; y < h; y++)
+        linhaBlocos(w, h, canais, y, img->data + (size_t)y * rowSize);
+    return img;
+}
+
+int executaTesteGrande(int w, int h, int canais, int n_filter)
+{
+    printf("Teste grande: %dx%d, %d canal(is), %.2f Gpixels, %.2f GB, filtro %d\n",
+           w, h, canais, (double)w * h / 1e9, (double)w * h * canais / 1e9, n_filter);
+    if (n_filter >= LADO_BLOCO)
+    {
+        printf("O filtro precisa ser menor que %d.\n", LADO_BLOCO);
+        return 1;
+    }
+
+    double t0 = relogio();
+    Image *img = imagemBlocos(w, h, canais);
+    if (!img)
+    {
+        printf("Memoria insuficiente.\n");
+        return 1;
+    }
+    double t1 = relogio();
+    filtroMediana(img, n_filter, BORDA_COPIAR, 0, 1);
+    grayscale(img);
+    double t2 = relogio();
+
+    size_t totalPixels = (size_t)w * h;
+    uint64_t histogram[256] = {0};
+    kernels.histograma(img->data, totalPixels, img->canais, histogram);
+    unsigned char map[256];
+    mapaEqualizacao(histogram, totalPixels, map);
+    kernels.aplicaLut(img->data, totalPixels, img->canais, map);
+    double t3 = relogio();
+
+    // Referência: o cinza esperado de cada pixel, contado linha a linha. Linhas simples do
+    // mesmo bloco repetem a anterior.
+    int raio = n_filter / 2;
+    size_t rowSize = (size_t)w * canais;
+    unsigned char *cinza = (unsigned char *)malloc(w);
+    unsigned char *certo = (unsigned char *)malloc(rowSize);
+    uint64_t esperado[256] = {0};
+    uint64_t contagemLinha[256];
+    int anterior = -1;
+    for (int y = 0; y < h; y++)
+    {
+        int chave = linhaSimples(h, raio, y);
+        if (chave < 0 || chave != anterior)
+        {
+            cinzaLinhaBlocos(w, h, canais, raio, y, cinza);
+            memset(contagemLinha, 0, sizeof(contagemLinha));
+            for (int x = 0; x < w; x++)
+                contagemLinha[cinza[x]]++;
+        }
+        anterior = chave;
+        for (int v = 0; v < 256; v++)
+            esperado[v] += contagemLinha[v];
+    }
+
+    int falhas = 0;
+    int dominante = 0;
+    for (int v = 0; v < 256; v++)
+    {
+        if (histogram[v] != esperado[v])
+        {
+            printf("  histograma[%d] = %llu, esperado %llu\n", v, (unsigned long long)histogram[v], (unsigned long long)esperado[v]);
+            falhas++;
+        }
+        if (esperado[v] > esperado[dominante])
+            dominante = v;
+    }
+
+    unsigned char mapaEsperado[256];
+    mapaEqualizacao(esperado, totalPixels, mapaEsperado);
+    anterior = -1;
+    for (int y = 0; y < h && falhas < 10; y++)
+    {
+        int chave = linhaSimples(h, raio, y);
+        if (chave < 0 || chave != anterior)
+        {
+            cinzaLinhaBlocos(w, h, canais, raio, y, cinza);
+            saidaLinhaBlocos(cinza, w, canais, mapaEsperado, certo);
+        }
+        anterior = chave;
+        const unsigned char *linha = img->data + (size_t)y * rowSize;
+        if (memcmp(linha, certo, rowSize) != 0)
+        {
+            size_t i = 0;
+            while (linha[i] == certo[i])
+                i++;
+            printf("  pixel (%zu, %d) canal %zu = %d, esperado %d\n", i / canais, y, i % canais, linha[i], certo[i]);
+            falhas++;
+        }
+    }
+    free(cinza);
+    free(certo);
+
+    printf("  nivel dominante %d: %llu pixels (%s 2^31)\n", dominante, (unsigned long long)esperado[dominante],
+           esperado[dominante] > INT32_MAX ? "acima de" : "abaixo de");
+    printf("  geracao %.3f s, mediana + cinza %.3f s, histograma + LUT %.3f s\n", t1 - t0, t2 - t1, t3 - t2);
+    printf("%s\n", falhas ? "FALHOU" : "ok");
+
+    liberaBuffer(img->data);
+    free(img);
+    return falhas ? 2 : 0;
+}
+
+// Modo luma (--luma): o cinza é calculado antes da mediana, que passa a rodar num canal
+// só, com um terço do trabalho e da memória. extraiCinza converte a imagem e copia o cinza
+// para um buffer de 1 canal; devolveCinza grava o resultado de volta em B, G e R, mantendo o alfa.
+Image *extraiCinza(Image *img)
+{
+    grayscale(img);
+
+    size_t totalPixels = (size_t)img->width * img->height;
+    Image *cinza = (Image *)malloc(sizeof(Image));
+    cinza->width = img->width;
+    cinza->height = img->height;
+    cinza->canais = 1;
+    cinza->topDown = img->topDown;
+    cinza->data = (unsigned char *)alocaBuffer(totalPixels);
+    for (size_t i = 0; i < totalPixels; i++)
+        cinza->data[i] = img->data[i * img->canais];
+    return cinza;
+}
+
+void devolveCinza(Image *img, const Image *cinza)
+{
+    size_t totalPixels = (size_t)img->width * img->height;
+    for (size_t i = 0; i < totalPixels; i++)
+    {
+        unsigned char *p = img->data + i * img->canais;
+        p[0] = p[1] = p[2] = cinza->data[i];
+    }
+}
+
+// Roda as duas ordens sobre cópias da imagem e mostra a diferença por pixel da saída final
+void comparaLuma(Image *img, int n_filter, ModoBorda modo, unsigned char valorBorda)
+{
+    size_t totalPixels = (size_t)img->width * img->height;
+    size_t bytes = totalPixels * img->canais;
+
+    Image atual = *img;
+    atual.data = (unsigned char *)alocaBuffer(bytes);
+    memcpy(atual.data, img->data, bytes);
+    double t0 = relogio();
+    filtroMediana(&atual, n_filter, modo, valorBorda, 0);
+    grayscale(&atual);
+    equalizacao(&atual);
+    double tempoAtual = relogio() - t0;
+
+    Image copia = *img;
+    copia.data = (unsigned char *)alocaBuffer(bytes);
+    memcpy(copia.data, img->data, bytes);
+    t0 = relogio();
+    Image *cinza = img->canais > 1 ? extraiCinza(&copia) : &copia;
+    filtroMediana(cinza, n_filter, modo, valorBorda, 0);
+    equalizacao(cinza);
+    double tempoLuma = relogio() - t0;
+
+    long soma = 0, diferentes = 0;
+    int maximo = 0;
+    long faixas[5] = {0}; // 0, 1, 2-3, 4-7, 8+
+    for (size_t i = 0; i < totalPixels; i++)
+    {
+        int d = abs((int)atual.data[i * atual.canais] - (int)cinza->data[i]);
+        soma += d;
+        diferentes += d > 0;
+        if (d > maximo)
+            maximo = d;
+        faixas[d == 0 ? 0 : d == 1 ? 1 : d < 4 ? 2 : d < 8 ? 3 : 4]++;
+    }
+
+    printf("Luma vs ordem atual (%zu pixels): %.2f%% diferentes, media %.3f, maximo %d\n",
+           totalPixels, 100.0 * diferentes / totalPixels, (double)soma / totalPixels, maximo);
+    printf("  |diferenca| 0: %.2f%%  1: %.2f%%  2-3: %.2f%%  4-7: %.2f%%  8+: %.2f%%\n",
+           100.0 * faixas[0] / totalPixels, 100.0 * faixas[1] / totalPixels, 100.0 * faixas[2] / totalPixels,
+           100.0 * faixas[3] / totalPixels, 100.0 * faixas[4] / totalPixels);
+    printf("  tempo: ordem atual %.4f s, luma %.4f s\n", tempoAtual, tempoLuma);
+
+    if (cinza != &copia)
+    {
+        liberaBuffer(cinza->data);
+        free(cinza);
+    }
+    liberaBuffer(copia.data);
+    liberaBuffer(atual.data);
+}
+
+// Prévia (--previa F): a imagem reduzida F vezes em cada eixo, pela média de blocos FxF,
+// passa pelas mesmas etapas e é gravada antes de a resolução total começar. A janela da
+// mediana encolhe na mesma proporção (no mínimo 3), para cobrir a mesma área da cena.
+// map recebe o mapa da equalização da prévia, que pode servir à resolução total.
+Image *reduzImagem(const Image *img, int fator)
+{
+    int canais = img->canais;
+    Image *red = (Image *)malloc(sizeof(Image));
+    red->width = (img->width + fator - 1) / fator;
+    red->height = (img->height + fator - 1) / fator;
+    red->canais = canais;
+    red->topDown = img->topDown;
+    red->data = (unsigned char *)alocaBuffer((size_t)red->width * red->height * canais);
+
+    for (int y = 0; y < red->height; y++)
+    {
+        int y0 = y * fator;
+        int y1 = y0 + fator < img->height ? y0 + fator : img->height;
+        for (int x = 0; x < red->width; x++)
+        {
+            int x0 = x * fator;
+            int x1 = x0 + fator < img->width ? x0 + fator : img->width;
+            int n = (y1 - y0) * (x1 - x0);
+            for (int c = 0; c < canais; c++)
+            {
+                int soma = 0;
+                for (int yy = y0; yy < y1; yy++)
+                {
+                    const unsigned char *linha = img->data + (size_t)yy * img->width * canais;
+                    for (int xx = x0; xx < x1; xx++)
+                        soma += linha[xx * canais + c];
+                }
+                red->data[((size_t)y * red->width + x) * canais + c] = (unsigned char)((soma + n / 2) / n);
+            }
+        }
+    }
+    return red;
+}
+
+Image *geraPrevia(const Image *img, int fator, int n_filter, ModoBorda modo, unsigned char valorBorda, int luma,
+                  unsigned char *map)
+{
+    int nPrevia = n_filter / fator;
+    if (nPrevia % 2 == 0)
+        nPrevia++;
+    if (nPrevia < 3)
+        nPrevia = 3;
+
+    Image *previa = reduzImagem(img, fator);
+    Image *cor = NULL;
+    if (luma && previa->canais > 1)
+    {
+        cor = previa;
+        previa = extraiCinza(cor);
+    }
+
+    filtroMediana(previa, nPrevia, modo, valorBorda, 0);
+    grayscale(previa);
+    equalizacaoMapa(previa, map);
+
+    if (cor)
+    {
+        devolveCinza(cor, previa);
+        liberaBuffer(previa->data);
+        free(previa);
+        previa = cor;
+    }
+    return previa;
+}
+
+// Cache em disco (--cache DIR), endereçado pelo conteúdo. A chave de cada estágio é um hash
+// dos pixels e das dimensões da entrada combinado com os parâmetros que mudam o resultado:
+//   <chave>.med  mediana + cinza (a entrada da equalização) e o histograma dela
+//   <chave>.out  o arquivo de saída final, pronto para copiar
+// Usar uma entrada renova o mtime dela; quando o diretório passa do limite, as entradas de
+// mtime mais antigo são apagadas primeiro (LRU).
+#define MAGICO_CACHE "EQC1"
+#define LIMITE_CACHE_MB 512
+// Entra em todas as chaves: 2 descarta as entradas gravadas com a mediana SIMD que errava
+// a partir de N = 17
+#define VERSAO_CHAVE_CACHE 2
+#define BLOCO_HASH (1 << 20)
+
+// xxHash64: quatro acumuladores independentes, uma multiplicação e uma rotação por palavra
+// de 8 bytes. Não é criptográfico, só identifica conteúdo.
+#define PRIMO64_1 0x9E3779B185EBCA87ULL
+#define PRIMO64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIMO64_3 0x165667B19E3779F9ULL
+#define PRIMO64_4 0x85EBCA77C2B2AE63ULL
+#define PRIMO64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotaciona64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t le64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t rodadaHash(uint64_t acc, uint64_t v)
+{
+    acc += v * PRIMO64_2;
+    return rotaciona64(acc, 31) * PRIMO64_1;
+}
+
+static inline uint64_t juntaHash(uint64_t h, uint64_t acc)
+{
+    h ^= rodadaHash(0, acc);
+    return h * PRIMO64_1 + PRIMO64_4;
+}
+
+uint64_t hashBytes(const void *dados, size_t n, uint64_t semente)
+{
+    const unsigned char *p = (const unsigned char *)dados;
+    const unsigned char *fim = p + n;
+    uint64_t h;
+
+    if (n >= 32)
+    {
+        uint64_t v1 = semente + PRIMO64_1 + PRIMO64_2;
+        uint64_t v2 = semente + PRIMO64_2;
+        uint64_t v3 = semente;
+        uint64_t v4 = semente - PRIMO64_1;
+        for (; p + 32 <= fim; p += 32)
+        {
+            v1 = rodadaHash(v1, le64(p));
+            v2 = rodadaHash(v2, le64(p + 8));
+            v3 = rodadaHash(v3, le64(p + 16));
+            v4 = rodadaHash(v4, le64(p + 24));
+        }
+        h = rotaciona64(v1, 1) + rotaciona64(v2, 7) + rotaciona64(v3, 12) + rotaciona64(v4, 18);
+        h = juntaHash(h, v1);
+        h = juntaHash(h, v2);
+        h = juntaHash(h, v3);
+        h = juntaHash(h, v4);
+    }
+    else
+        h = semente + PRIMO64_5;
+
+    h += n;
+    for (; p + 8 <= fim; p += 8)
+    {
+        h ^= rodadaHash(0, le64(p));
+        h = rotaciona64(h, 27) * PRIMO64_1 + PRIMO64_4;
+    }
+    if (p + 4 <= fim)
+    {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h ^= v * PRIMO64_1;
+        h = rotaciona64(h, 23) * PRIMO64_2 + PRIMO64_3;
+        p += 4;
+    }
+    for (; p < fim; p++)
+    {
+        h ^= *p * PRIMO64_5;
+        h = rotaciona64(h, 11) * PRIMO64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIMO64_2;
+    h ^= h >> 29;
+    h *= PRIMO64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Hash da imagem em blocos de 1 MB, com o hash de cada bloco entrando no final: os blocos
+// são independentes e a chave é a mesma nas versões sequencial e OpenMP
+uint64_t hashImagem(const Image *img)
+{
+    uint32_t dimensoes[4] = {img->width, img->height, img->canais, img->topDown};
+    size_t total = (size_t)img->width * img->height * img->canais;
+    size_t nBlocos = (total + BLOCO_HASH - 1) / BLOCO_HASH;
+    uint64_t *hashes = (uint64_t *)alocaBuffer(nBlocos * sizeof(uint64_t));
+
+    for (size_t b = 0; b < nBlocos; b++)
+    {
+        size_t inicio = b * BLOCO_HASH;
+        size_t n = total - inicio < BLOCO_HASH ? total - inicio : BLOCO_HASH;
+        hashes[b] = hashBytes(img->data + inicio, n, b);
+    }
+
+    uint64_t h = hashBytes(hashes, nBlocos * sizeof(uint64_t), hashBytes(dimensoes, sizeof(dimensoes), 0));
+    liberaBuffer(hashes);
+    return h;
+}
+
+// Chave do estágio mediana + cinza: só entra o que muda o resultado. ISA e in-place não mudam;
+// --confere-isas (versão sequencial) compara os kernels de cada ISA com os escalares.
+uint64_t chaveMediana(uint64_t hashEntrada, int n_filter, ModoBorda modo, unsigned char valorBorda, int luma)
+{
+    int32_t parametros[5] = {VERSAO_CHAVE_CACHE, n_filter, modo, modo == BORDA_CONSTANTE ? valorBorda : 0, luma};
+    uint64_t chave = hashBytes(parametros, sizeof(parametros), hashEntrada);
+    // Com tolerância 0 a mediana é exata e as entradas antigas continuam valendo
+    if (toleranciaPlano > 0)
+        chave = hashBytes(&toleranciaPlano, sizeof(toleranciaPlano), chave);
+    return chave;
+}
+
+// Chave da saída final: a do estágio anterior mais o formato de gravação
+uint64_t chaveSaida(uint64_t chaveMed, int rle8)
+{
+    int32_t parametros[1] = {rle8};
+    return hashBytes(parametros, sizeof(parametros), chaveMed);
+}
+
+void caminhoCache(char *caminho, size_t n, const char *dir, uint64_t chave, const char *extensao)
+{
+    snprintf(caminho, n, "%s/%016llx.%s", dir, (unsigned long long)chave, extensao);
+}
+
+int copiaArquivo(const char *origem, const char *destino)
+{
+    FILE *in = fopen(origem, "rb");
+    if (!in)
+        return 0;
+    FILE *out = fopen(destino, "wb");
+    if (!out)
+    {
+        fclose(in);
+        return 0;
+    }
+
+    char buffer[1 << 16];
+    size_t n;
+    int ok = 1;
+    while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+        ok = fwrite(buffer, 1, n, out) == n;
+    fclose(in);
+    if (fclose(out) != 0)
+        ok = 0;
+    return ok;
+}
+
+// Copia a saída guardada para arquivoSaida; 0 se a entrada não existe
+int leSaidaCache(const char *dir, uint64_t chave, const char *arquivoSaida)
+{
+    char caminho[4096];
+    caminhoCache(caminho, sizeof(caminho), dir, chave, "out");
+    if (!copiaArquivo(caminho, arquivoSaida))
+        return 0;
+    utime(caminho, NULL);
+    return 1;
+}
+
+// As entradas são gravadas num temporário e renomeadas: um processo concorrente nunca vê
+// uma entrada pela metade
+void gravaSaidaCache(const char *dir, uint64_t chave, const char *arquivoSaida)
+{
+    char caminho[4096], temporario[4200];
+    caminhoCache(caminho, sizeof(caminho), dir, chave, "out");
+    snprintf(temporario, sizeof(temporario), "%s.%d", caminho, (int)getpid());
+    if (copiaArquivo(arquivoSaida, temporario))
+        rename(temporario, caminho);
+    else
+        remove(temporario);
+}
+
+// Troca os pixels de img (já com as dimensões da entrada) pela mediana + cinza guardada e
+// preenche o histograma dela; 0 se a entrada não existe ou não confere
+int leIntermediario(const char *dir, uint64_t chave, Image *img, uint64_t *histogram)
+{
+    char caminho[4096];
+    caminhoCache(caminho, sizeof(caminho), dir, chave, "med");
+    FILE *f = fopen(caminho, "rb");
+    if (!f)
+        return 0;
+
+    size_t tamanho = (size_t)img->width * img->height * img->canais;
+    char magico[4];
+    uint32_t cabecalho[4];
+    unsigned char *data = (unsigned char *)alocaBuffer(tamanho);
+    int ok = fread(magico, 1, 4, f) == 4 && memcmp(magico, MAGICO_CACHE, 4) == 0 &&
+             fread(cabecalho, sizeof(uint32_t), 4, f) == 4 &&
+             cabecalho[0] == (uint32_t)img->width && cabecalho[1] == (uint32_t)img->height &&
+             cabecalho[2] == (uint32_t)img->canais && cabecalho[3] == (uint32_t)img->topDown &&
+             fread(histogram, sizeof(uint64_t), 256, f) == 256 &&
+             fread(data, 1, tamanho, f) == tamanho;
+    fclose(f);
+
+    if (!ok)
+    {
+        liberaBuffer(data);
+        return 0;
+    }
+    liberaBuffer(img->data);
+    img->data = data;
+    utime(caminho, NULL);
+    return 1;
+}
+
+void gravaIntermediario(const char *dir, uint64_t chave, const Image *img, const uint64_t *histogram)
+{
+    char caminho[4096], temporario[4200];
+    caminhoCache(caminho, sizeof(caminho), dir, chave, "med");
+    snprintf(temporario, sizeof(temporario), "%s.%d", caminho, (int)getpid());
+    FILE *f = fopen(temporario, "wb");
+    if (!f)
+        return;
+
+    uint32_t cabecalho[4] = {img->width, img->height, img->canais, img->topDown};
+    size_t tamanho = (size_t)img->width * img->height * img->canais;
+    fwrite(MAGICO_CACHE, 1, 4, f);
+    fwrite(cabecalho, sizeof(uint32_t), 4, f);
+    fwrite(histogram, sizeof(uint64_t), 256, f);
+    int ok = fwrite(img->data, 1, tamanho, f) == tamanho;
+    if (fclose(f) != 0 || !ok)
+        remove(temporario);
+    else
+        rename(temporario, caminho);
+}
+
+typedef struct
+{
+    char nome[256];
+    off_t tamanho;
+    time_t uso; // st_mtime, que existe em todo POSIX; utime marca os acertos com resolução de segundos
+} EntradaCache;
+
+int comparaUso(const void *a, const void *b)
+{
+    time_t ta = ((const EntradaCache *)a)->uso;
+    time_t tb = ((const EntradaCache *)b)->uso;
+    return (ta > tb) - (ta < tb);
+}
+
+// Apaga as entradas usadas há mais tempo até o cache caber em limite bytes
+void limitaCache(const char *dir, uint64_t limite)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+
+    EntradaCache *entradas = NULL;
+    int n = 0, capacidade = 0;
+    uint64_t total = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+    {
+        const char *extensao = strrchr(e->d_name, '.');
+        if (!extensao || (strcmp(extensao, ".med") != 0 && strcmp(extensao, ".out") != 0))
+            continue;
+
+        char caminho[4096];
+        struct stat st;
+        snprintf(caminho, sizeof(caminho), "%s/%s", dir, e->d_name);
+        if (stat(caminho, &st) != 0)
+            continue;
+
+        if (n == capacidade)
+        {
+            capacidade = capacidade ? 2 * capacidade : 64;
+            entradas = (EntradaCache *)realloc(entradas, capacidade * sizeof(EntradaCache));
+        }
+        snprintf(entradas[n].nome, sizeof(entradas[n].nome), "%s", e->d_name);
+        entradas[n].tamanho = st.st_size;
+        entradas[n].uso = st.st_mtime;
+        total += st.st_size;
+        n++;
+    }
+    closedir(d);
+
+    qsort(entradas, n, sizeof(EntradaCache), comparaUso);
+    for (int i = 0; i < n && total > limite; i++)
+    {
+        char caminho[4096];
+        snprintf(caminho, sizeof(caminho), "%s/%s", dir, entradas[i].nome);
+        if (remove(caminho) == 0)
+            total -= entradas[i].tamanho;
+    }
+    free(entradas);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *inputFilename = "../bitmaps/small.bmp";
+    const char *outputFilename = "output.bmp";
+    int n_filter = N_FILTER;
+    Isa isa = melhorIsa();
+    ModoBorda borda = BORDA_COPIAR;
+    unsigned char valorBorda = 0;
+    int inPlace = 0;
+    int rle8 = 0;
+    const char *gravarTiles = NULL;
+    int ladoTile = LADO_TILE;
+    int temRegiao = 0, rx = 0, ry = 0, rw = 0, rh = 0, mapaGlobal = 0;
+    int luma = 0, compararLuma = 0;
+    const char *cacheDir = NULL;
+    uint64_t limiteCache = (uint64_t)LIMITE_CACHE_MB << 20;
+    int bench = 0, benchW = 2048, benchH = 2048;
+    int confere = 0;
+    const char *baseline = NULL, *gravarBaseline = NULL;
+    double tolerancia = 10.0;
+    int testeW = 0, testeH = 0, testeCanais = 1;
+    int previa = 0, usaMapaPrevia = 0;
+    const char *saidaPrevia = "previa.bmp";
+    int plano = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--filtro") == 0 && i + 1 < argc)
+        {
+            n_filter = atoi(argv[++i]);
+            if (n_filter < 1 || n_filter > FILTRO_MAXIMO)
+            {
+                printf("Tamanho de filtro invalido: %s (use 1 a %d)\n", argv[i], FILTRO_MAXIMO);
+                return 1;
+            }
+            if (n_filter % 2 == 0)
+                n_filter++; // Garante ímpar
+        }
+        else if (strcmp(argv[i], "--borda") == 0 && i + 1 < argc)
+        {
+            if (!leModoBorda(argv[++i], &borda))
+            {
+                printf("Modo de borda invalido: %s (use copiar, replicar, refletir ou constante)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--valor-borda") == 0 && i + 1 < argc)
+        {
+            valorBorda = (unsigned char)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+        {
+            if (!leIsa(argv[++i], &isa))
+            {
+                printf("ISA invalida: %s (use escalar, sse4.1, avx2 ou avx512)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--in-place") == 0)
+        {
+            inPlace = 1;
+        }
+        else if (strcmp(argv[i], "--rle8") == 0)
+        {
+            rle8 = 1;
+        }
+        else if (strcmp(argv[i], "--gravar-tiles") == 0 && i + 1 < argc)
+        {
+            gravarTiles = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc)
+        {
+            ladoTile = atoi(argv[++i]);
+            if (ladoTile <= 0 || ladoTile > 65535) // O histograma de cada tile é de 32 bits
+            {
+                printf("Lado de tile invalido: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--regiao") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%d,%d,%dx%d", &rx, &ry, &rw, &rh) != 4 || rx < 0 || ry < 0 || rw <= 0 || rh <= 0)
+            {
+                printf("Regiao invalida: %s (use X,Y,LARGURAxALTURA)\n", argv[i]);
+                return 1;
+            }
+            temRegiao = 1;
+        }
+        else if (strcmp(argv[i], "--mapa-global") == 0)
+        {
+            mapaGlobal = 1;
+        }
+        else if (strcmp(argv[i], "--luma") == 0)
+        {
+            luma = 1;
+        }
+        else if (strcmp(argv[i], "--comparar-luma") == 0)
+        {
+            compararLuma = 1;
+        }
+        else if (strcmp(argv[i], "--plano") == 0)
+        {
+            plano = 1;
+        }
+        else if (strcmp(argv[i], "--tolerancia-plano") == 0 && i + 1 < argc)
+        {
+            toleranciaPlano = atoi(argv[++i]);
+            if (toleranciaPlano < 0 || toleranciaPlano > 255)
+            {
+                printf("Tolerancia invalida: %s (use 0 a 255)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--previa") == 0 && i + 1 < argc)
+        {
+            previa = atoi(argv[++i]);
+            if (previa < 2)
+            {
+                printf("Fator de previa invalido: %s (use 2, 4, ...)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--saida-previa") == 0 && i + 1 < argc)
+        {
+            saidaPrevia = argv[++i];
+        }
+        else if (strcmp(argv[i], "--mapa-previa") == 0)
+        {
+            usaMapaPrevia = 1;
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+        {
+            cacheDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache-limite") == 0 && i + 1 < argc)
+        {
+            limiteCache = (uint64_t)atoll(argv[++i]) << 20;
+        }
+        else if (strcmp(argv[i], "--sem-pool") == 0)
+        {
+            poolAtivo = 0;
+        }
+        else if (strcmp(argv[i], "--bench") == 0)
+        {
+            bench = 1;
+        }
+        else if (strcmp(argv[i], "--confere-isas") == 0)
+        {
+            confere = 1;
+        }
+        else if (strcmp(argv[i], "--dim") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%d", &benchW, &benchH) != 2 || benchW <= 0 || benchH <= 0)
+            {
+                printf("Dimensao invalida: %s (use LARGURAxALTURA)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--teste-grande") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%dx%d", &testeW, &testeH, &testeCanais) < 2 || testeW <= 0 || testeH <= 0 ||
+                (testeCanais != 1 && testeCanais != 3 && testeCanais != 4))
+            {
+                printf("Dimensao invalida: %s (use LARGURAxALTURA[xCANAIS], canais 1, 3 ou 4)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+        {
+            baseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "--gravar-baseline") == 0 && i + 1 < argc)
+        {
+            gravarBaseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tolerancia") == 0 && i + 1 < argc)
+        {
+            tolerancia = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--entrada") == 0 && i + 1 < argc)
+        {
+            inputFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--saida") == 0 && i + 1 < argc)
+        {
+            outputFilename = argv[++i];
+        }
+        else
+        {
+            printf("Uso: %s [--filtro N] [--entrada arquivo.bmp] [--saida arquivo.bmp]\n"
+                   "       [--borda copiar|replicar|refletir|constante] [--valor-borda V]\n"
+                   "       [--isa escalar|sse4.1|avx2|avx512] [--in-place] [--sem-pool] [--rle8]\n"
+                   "       [--gravar-tiles arq.eqt [--tile N]] [--regiao X,Y,LxA [--mapa-global]]\n"
+                   "       [--luma] [--comparar-luma] [--cache DIR [--cache-limite MB]]\n"
+                   "       [--bench [--dim LxA] [--baseline arq] [--gravar-baseline arq] [--tolerancia %%]] [--confere-isas]\n"
+                   "       [--teste-grande LxA[xC]] [--previa F [--saida-previa arq] [--mapa-previa]]\n"
+                   "       [--plano] [--tolerancia-plano T]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!selecionaKernels(isa))
+    {
+        printf("ISA '%s' nao suportada por esta CPU.\n", nomesIsa[isa]);
+        return 1;
+    }
+    if (plano && toleranciaPlano < 0)
+        toleranciaPlano = 0;
+
+    if (confere)
+        return confereIsas();
+    if (bench)
+        return executaBench(benchW, benchH, baseline, gravarBaseline, tolerancia);
+    if (testeW > 0)
+        return executaTesteGrande(testeW, testeH, testeCanais, n_filter);
+
+    // A chave do cache vem da imagem inteira: recortes e .eqt ficam de fora
+    if (cacheDir && (temRegiao || ehArquivoTiles(inputFilename)))
+    {
+        printf("--cache ignorado com --regiao ou entrada .eqt.\n");
+        cacheDir = NULL;
+    }
+    if (previa && (temRegiao || ehArquivoTiles(inputFilename)))
+    {
+        printf("--previa ignorada com --regiao ou entrada .eqt.\n");
+        previa = 0;
+    }
+    if (!previa)
+        usaMapaPrevia = 0;
+    // O mapa da prévia muda a saída, que então não corresponde à chave do cache
+    if (cacheDir && usaMapaPrevia)
+    {
+        printf("--cache ignorado com --mapa-previa.\n");
+        cacheDir = NULL;
+    }
+    if (cacheDir)
+        mkdir(cacheDir, 0755);
+
+    Image *img;
+    uint64_t chaveMed = 0;
+    double inicio = relogio();
+    if (ehArquivoTiles(inputFilename))
+    {
+        // O .eqt já guarda a imagem filtrada e em tons de cinza
+        img = equalizaTiles(inputFilename, temRegiao, rx, ry, rw, rh, mapaGlobal);
+        if (!img)
+        {
+            printf("Erro: Arquivo '%s' invalido.\n", inputFilename);
+            return 1;
+        }
+    }
+    else
+    {
+        // Com região, só o retângulo e o halo da mediana são lidos e processados
+        int dx = 0, dy = 0;
+        img = temRegiao ? leBitMapRegiao(inputFilename, 1, rx, ry, rw, rh, n_filter / 2, 1, &dx, &dy) : leBitMap(inputFilename);
+        if (!img)
+        {
+            printf("Erro: Arquivo '%s' nao encontrado ou invalido.\n", inputFilename);
+            return 1;
+        }
+
+        if (compararLuma)
+            comparaLuma(img, n_filter, borda, valorBorda);
+
+        // A prévia sai antes de a resolução total começar, mesmo quando ela vem do cache
+        unsigned char mapaPrevia[256];
+        if (previa)
+        {
+            Image *p = geraPrevia(img, previa, n_filter, borda, valorBorda, luma, mapaPrevia);
+            if (rle8)
+                escreveBitMapRle8(saidaPrevia, p);
+            else
+                escreveBitMap(saidaPrevia, p);
+            printf("Previa %dx (%dx%d) salva em '%s' em %.4f segundos.\n", previa, p->width, p->height, saidaPrevia,
+                   relogio() - inicio);
+            fflush(stdout);
+            liberaBuffer(p->data);
+            free(p);
+        }
+
+        // Com a saída final no cache o pipeline inteiro é pulado
+        if (cacheDir)
+        {
+            chaveMed = chaveMediana(hashImagem(img), n_filter, borda, valorBorda, luma && img->canais > 1);
+            if (!gravarTiles && leSaidaCache(cacheDir, chaveSaida(chaveMed, rle8), outputFilename))
+            {
+                printf("Saida recuperada do cache em '%s'.\n", outputFilename);
+                limitaCache(cacheDir, limiteCache);
+                liberaBuffer(img->data);
+                free(img);
+                liberaPool();
+                return 0;
+            }
+        }
+
+        // No modo luma a imagem colorida só guarda o alfa até a gravação
+        Image *cor = NULL;
+        if (luma && img->canais > 1)
+        {
+            cor = img;
+            img = extraiCinza(cor);
+        }
+
+        // Sem a saída, a mediana + cinza e o histograma ainda podem estar no cache
+        uint64_t histogram[256] = {0};
+        if (cacheDir && leIntermediario(cacheDir, chaveMed, img, histogram))
+            printf("Mediana recuperada do cache.\n");
+        else
+        {
+            filtroMediana(img, n_filter, borda, valorBorda, inPlace);
+            if (temRegiao)
+            {
+                recortaImagem(img, dx, dy, rw, rh);
+                if (cor)
+                    recortaImagem(cor, dx, dy, rw, rh);
+            }
+            grayscale(img);
+            if (cacheDir)
+            {
+                kernels.histograma(img->data, (size_t)img->width * img->height, img->canais, histogram);
+                gravaIntermediario(cacheDir, chaveMed, img, histogram);
+            }
+        }
+        if (gravarTiles && gravaTiles(gravarTiles, img, ladoTile))
+            printf("Tiles salvos em '%s'.\n", gravarTiles);
+
+        if (temRegiao && mapaGlobal)
+        {
+            uint64_t histogram[256] = {0};
+            uint64_t amostras = histogramaAmostrado(inputFilename, histogram);
+            unsigned char map[256];
+            mapaEqualizacao(histogram, amostras, map);
+            kernels.aplicaLut(img->data, (size_t)img->width * img->height, img->canais, map);
+        }
+        else if (cacheDir)
+        {
+            unsigned char map[256];
+            mapaEqualizacao(histogram, (uint64_t)img->width * img->height, map);
+            kernels.aplicaLut(img->data, (size_t)img->width * img->height, img->canais, map);
+        }
+        else if (usaMapaPrevia)
+            kernels.aplicaLut(img->data, (size_t)img->width * img->height, img->canais, mapaPrevia); // Sem o histograma
+        else
+            equalizacao(img);
+
+        if (cor)
+        {
+            devolveCinza(cor, img);
+            liberaBuffer(img->data);
+            free(img);
+            img = cor;
+        }
+    }
+
+    if (rle8)
+        escreveBitMapRle8(outputFilename, img);
+    else
+        escreveBitMap(outputFilename, img);
+    if (previa)
+        printf("Resolucao total salva em '%s' em %.4f segundos.\n", outputFilename, relogio() - inicio);
+    else
+        printf("Imagem salva em '%s'.\n", outputFilename);
+
+    if (cacheDir)
+    {
+        gravaSaidaCache(cacheDir, chaveSaida(chaveMed, rle8), outputFilename);
+        limitaCache(cacheDir, limiteCache);
+    }
 
-    free(img->data);
+    liberaBuffer(img->data);
     free(img);
+    liberaPool();
 
     return 0;
 }
\ No newline at end of file